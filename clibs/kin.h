@@ -1,236 +1,2613 @@
 #ifndef KIN_VALUE_H
 #define KIN_VALUE_H
 
+// The driver compiles with -std=c99, which hides POSIX and BSD declarations like
+// fdopen and madvise unless they are asked for before the first system header
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <math.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-static char** kin_call_stack = NULL;
-static size_t kin_call_stack_len = 0;
-static size_t kin_call_stack_capacity = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef KIN_STATS
+#include <signal.h>
+#endif
+
+#ifdef KIN_PARALLEL
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "kin_runtime.h"
+
+#ifdef KIN_EMBED
+#if defined(KIN_SHARD) || defined(KIN_SHARDED)
+#error "KIN_EMBED keeps the runtime private to one unit, so it cannot be used with shards"
+#endif
+#ifdef KIN_PARALLEL
+#error "KIN_EMBED returns panics to the host's thread, so it cannot be used with KIN_PARALLEL"
+#endif
+#endif
+
+// A transpiled program can be split into shards, which are translation units
+// that each define KIN_SHARD and only get declarations of the runtime's
+// functions and mutable state. The unit that defines KIN_SHARDED holds their
+// single definitions, so function values stay comparable across shards.
+#if defined(KIN_SHARD)
+#define kin_global(decl, ...) extern decl
+#elif defined(KIN_SHARDED)
+#define kin_global(decl, ...) decl = __VA_ARGS__
+#else
+#define kin_global(decl, ...) static decl = __VA_ARGS__
+#endif
+
+// The runtime's functions are likewise only shared between shards. An
+// embedded program keeps them to itself, so a host can link several programs.
+#if defined(KIN_SHARD) || defined(KIN_SHARDED)
+#define kin_fn
+#else
+#define kin_fn static
+#endif
+
+// With KIN_PARALLEL, tasks run on several threads, which each have their own
+// runtime. With KIN_EMBED, each host thread runs programs with its own runtime.
+#if defined(KIN_PARALLEL) || defined(KIN_EMBED)
+#define kin_thread_local __thread
+#else
+#define kin_thread_local
+#endif
+
+// A location in the Kin source from which a function or operator is called
+typedef struct KinCallSite {
+    char* function;
+    uint32_t line;
+    uint32_t col;
+} KinCallSite;
+
+// The runtime of the current thread. An embedded program uses the one its
+// host passes to the entry point, and is otherwise given one of its own.
+#ifdef KIN_EMBED
+kin_global(kin_thread_local KinRuntime* kin_rt, NULL);
+#else
+kin_global(kin_thread_local KinRuntime kin_thread_runtime, { 0 });
+#define kin_rt (&kin_thread_runtime)
+#endif
+
+// The runtime's state is named as if it were global
+#define kin_call_sites (kin_rt->call_sites)
+#define kin_frame (kin_rt->frame)
+#define kin_call_stack (kin_rt->call_stack)
+#define kin_call_stack_len (kin_rt->call_stack_len)
+#define kin_call_stack_capacity (kin_rt->call_stack_capacity)
+#ifdef KIN_PARALLEL
+// Tasks do not print, but a task that panics on a worker flushes what the main
+// thread printed before it, so the output buffer is shared by every thread.
+// Only the first thread to panic reports it.
+kin_global(char kin_shared_out[KIN_OUT_SIZE], { 0 });
+kin_global(size_t kin_shared_out_len, 0);
+kin_global(pthread_mutex_t kin_panic_lock, PTHREAD_MUTEX_INITIALIZER);
+#define kin_out kin_shared_out
+#define kin_out_len kin_shared_out_len
+#else
+#define kin_out (kin_rt->out)
+#define kin_out_len (kin_rt->out_len)
+#endif
+#define kin_arena (kin_rt->arena)
+#define kin_arena_spare (kin_rt->arena_spare)
+#define kin_intern_table (kin_rt->intern_table)
+#define kin_intern_capacity (kin_rt->intern_capacity)
+#define kin_intern_len (kin_rt->intern_len)
+#define kin_files (kin_rt->files)
+
+static inline FILE* kin_output() {
+    return kin_rt->output ? kin_rt->output : stdout;
+}
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifdef KIN_SITE_TABLE
+
+#ifdef KIN_PROFILE
+#error "KIN_PROFILE times calls on the call stack, so it cannot be used with KIN_SITE_TABLE"
+#endif
+
+// With KIN_SITE_TABLE, each generated function links a frame into a chain
+// on the C stack and a call only stores its site index in the caller's
+// frame. The trace is rebuilt from the chain when a panic occurs.
+typedef struct KinFrame {
+    struct KinFrame* parent;
+    uint32_t site;
+} KinFrame;
+
+
+#define kin_enter_frame(function) KinFrame kin_local_frame = { kin_frame, 0 }; kin_frame = &kin_local_frame
+// Return a value of the given C type, which is not a KinValue for typed clones
+#define kin_return_as(type, ...) do { \
+    type kin_ret = (__VA_ARGS__); \
+    kin_frame = kin_local_frame.parent; \
+    return kin_ret; \
+} while (0)
+
+#ifdef KIN_SHARD
+void kin_print_call_stack();
+#else
+kin_fn void kin_print_call_stack() {
+    for (KinFrame* frame = kin_frame; frame; frame = frame->parent)
+        if (frame->site) {
+            KinCallSite site = kin_call_sites[frame->site];
+            fprintf(kin_output(), "at %s %u:%u\n", site.function, site.line, site.col);
+        }
+}
+#endif
+
+#else
+
+
+#define kin_return_as(type, ...) return (__VA_ARGS__)
+
+#ifdef KIN_PROFILE
+
+#if defined(KIN_PARALLEL) || defined(KIN_EMBED)
+#error "KIN_PROFILE keeps one call tree, so it cannot be used with KIN_PARALLEL or KIN_EMBED"
+#endif
+
+// With KIN_PROFILE, every call on the call stack is counted and timed, and a
+// report per Kin function and call site is written to kin-profile.txt at exit,
+// along with a folded stack file for flame graph tools in kin-profile.folded.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define kin_cycles() __rdtsc()
+#elif defined(__aarch64__)
+static inline uint64_t kin_cycles() {
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+}
+#else
+#include <time.h>
+#define kin_cycles() ((uint64_t)clock())
+#endif
+
+// A function called from a call site under the calls on the stack above it.
+// A call to a function from a site it is already being called from further up
+// the stack is counted in that node, so recursion does not grow the tree.
+typedef struct KinProfileNode {
+    uint32_t parent;
+    uint32_t site;
+    // NULL for builtins
+    const char* function;
+    // The calls of the node that are on the stack
+    uint32_t active;
+    uint64_t calls;
+    uint64_t self_cycles;
+    // Including callees. Only the outermost of nested calls is counted.
+    uint64_t cycles;
+} KinProfileNode;
+
+typedef struct KinProfileSlot {
+    uint32_t parent;
+    uint32_t site;
+    const char* function;
+    uint32_t node;
+} KinProfileSlot;
+
+// A call on the call stack. Its node is found once the callee is known.
+typedef struct KinProfileCall {
+    uint32_t node;
+    uint64_t start;
+    uint64_t child_cycles;
+} KinProfileCall;
+
+// Node 0 is main
+kin_global(KinProfileNode* kin_profile_nodes, NULL);
+kin_global(size_t kin_profile_node_count, 0);
+kin_global(size_t kin_profile_node_capacity, 0);
+kin_global(KinProfileSlot* kin_profile_slots, NULL);
+kin_global(size_t kin_profile_slot_count, 0);
+kin_global(size_t kin_profile_slot_capacity, 0);
+kin_global(KinProfileCall* kin_profile_calls, NULL);
+kin_global(uint64_t kin_profile_start, 0);
+kin_global(uint64_t kin_profile_main_child_cycles, 0);
+
+static inline size_t kin_profile_hash(uint32_t parent, uint32_t site, const char* function) {
+    uint64_t hash = ((uint64_t)parent << 32 | site) * 0x9e3779b97f4a7c15ull ^ (uintptr_t)function;
+    return (size_t)(hash ^ hash >> 29);
+}
+
+static KinProfileSlot* kin_profile_slot(uint32_t parent, uint32_t site, const char* function) {
+    size_t mask = kin_profile_slot_capacity - 1;
+    size_t i = kin_profile_hash(parent, site, function) & mask;
+    while (kin_profile_slots[i].node) {
+        KinProfileSlot* slot = &kin_profile_slots[i];
+        if (slot->parent == parent && slot->site == site && slot->function == function) break;
+        i = (i + 1) & mask;
+    }
+    return &kin_profile_slots[i];
+}
+
+static void kin_profile_grow_slots() {
+    KinProfileSlot* old = kin_profile_slots;
+    size_t old_capacity = kin_profile_slot_capacity;
+    kin_profile_slot_capacity = old_capacity ? old_capacity * 2 : 256;
+    kin_profile_slots = (KinProfileSlot*)calloc(kin_profile_slot_capacity, sizeof(KinProfileSlot));
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].node) *kin_profile_slot(old[i].parent, old[i].site, old[i].function) = old[i];
+    free(old);
+}
+
+static uint32_t kin_profile_new_node(uint32_t parent, uint32_t site, const char* function) {
+    if (kin_profile_node_count == kin_profile_node_capacity) {
+        kin_profile_node_capacity = kin_profile_node_capacity ? kin_profile_node_capacity * 2 : 256;
+        kin_profile_nodes = (KinProfileNode*)realloc(kin_profile_nodes, kin_profile_node_capacity * sizeof(KinProfileNode));
+    }
+    kin_profile_nodes[kin_profile_node_count] = (KinProfileNode) { parent, site, function, 0, 0, 0, 0 };
+    return kin_profile_node_count++;
+}
+
+static uint32_t kin_profile_node(uint32_t parent, uint32_t site, const char* function) {
+    if ((kin_profile_slot_count + 1) * 2 > kin_profile_slot_capacity) kin_profile_grow_slots();
+    KinProfileSlot* slot = kin_profile_slot(parent, site, function);
+    if (slot->node) return slot->node;
+    uint32_t node = 0;
+    for (uint32_t up = parent; up; up = kin_profile_nodes[up].parent)
+        if (kin_profile_nodes[up].site == site && kin_profile_nodes[up].function == function) {
+            node = up;
+            break;
+        }
+    if (!node) node = kin_profile_new_node(parent, site, function);
+    *slot = (KinProfileSlot) { parent, site, function, node };
+    kin_profile_slot_count++;
+    return node;
+}
+
+// Get the node of the call at a depth of the call stack
+static uint32_t kin_profile_resolve(size_t depth, const char* function) {
+    KinProfileCall* call = &kin_profile_calls[depth];
+    if (!call->node) {
+        uint32_t parent = depth ? kin_profile_resolve(depth - 1, NULL) : 0;
+        uint32_t node = kin_profile_node(parent, kin_call_stack[depth], function);
+        kin_profile_calls[depth].node = node;
+        kin_profile_nodes[node].active++;
+        kin_profile_nodes[node].calls++;
+    }
+    return kin_profile_calls[depth].node;
+}
+
+static void kin_profile_print_path(FILE* file, uint32_t node) {
+    if (node) {
+        kin_profile_print_path(file, kin_profile_nodes[node].parent);
+        fputc(';', file);
+    }
+    const char* function = kin_profile_nodes[node].function;
+    fputs(function ? function : "builtin", file);
+}
+
+// The counts of a function or call site
+typedef struct KinProfileTotal {
+    const char* function;
+    uint32_t site;
+    uint64_t calls;
+    uint64_t self_cycles;
+    uint64_t cycles;
+} KinProfileTotal;
+
+static int kin_profile_total_cmp(const void* a, const void* b) {
+    uint64_t x = ((const KinProfileTotal*)a)->self_cycles, y = ((const KinProfileTotal*)b)->self_cycles;
+    return (x < y) - (x > y);
+}
+
+static bool kin_profile_same_function(const char* a, const char* b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+// Sum the nodes of each function, or of each call site if by_site
+static size_t kin_profile_totals(KinProfileTotal* totals, bool by_site) {
+    size_t count = 0;
+    for (uint32_t n = 0; n < kin_profile_node_count; n++) {
+        KinProfileNode* node = &kin_profile_nodes[n];
+        size_t i = 0;
+        while (i < count && (by_site ? totals[i].site != node->site : !kin_profile_same_function(totals[i].function, node->function)))
+            i++;
+        if (i == count) totals[count++] = (KinProfileTotal) { node->function, node->site, 0, 0, 0 };
+        totals[i].calls += node->calls;
+        totals[i].self_cycles += node->self_cycles;
+        // A node's cycles already include those of the nodes below it
+        bool nested = false;
+        for (uint32_t up = n ? node->parent : 0; up && !nested; up = kin_profile_nodes[up].parent)
+            nested = by_site ? kin_profile_nodes[up].site == node->site : kin_profile_same_function(kin_profile_nodes[up].function, node->function);
+        if (!nested) totals[i].cycles += node->cycles;
+    }
+    qsort(totals, count, sizeof(KinProfileTotal), kin_profile_total_cmp);
+    return count;
+}
+
+static void kin_profile_report() {
+    KinProfileNode* main_node = &kin_profile_nodes[0];
+    main_node->cycles = kin_cycles() - kin_profile_start;
+    main_node->self_cycles = main_node->cycles - kin_profile_main_child_cycles;
+    FILE* folded = fopen("kin-profile.folded", "w");
+    if (folded) {
+        for (uint32_t n = 0; n < kin_profile_node_count; n++)
+            if (kin_profile_nodes[n].self_cycles) {
+                kin_profile_print_path(folded, n);
+                fprintf(folded, " %llu\n", (unsigned long long)kin_profile_nodes[n].self_cycles);
+            }
+        fclose(folded);
+    }
+    FILE* report = fopen("kin-profile.txt", "w");
+    if (!report) return;
+    KinProfileTotal* totals = (KinProfileTotal*)malloc(kin_profile_node_count * sizeof(KinProfileTotal));
+    double all_cycles = main_node->cycles ? (double)main_node->cycles : 1;
+    for (int by_site = 0; by_site < 2; by_site++) {
+        size_t count = kin_profile_totals(totals, by_site);
+        fprintf(report, "%-32s %12s %16s %7s %16s\n", by_site ? "call site" : "function", "calls", "self cycles", "self", "total cycles");
+        for (size_t i = 0; i < count; i++) {
+            char name[64];
+            if (by_site && totals[i].site) {
+                KinCallSite site = kin_call_sites[totals[i].site];
+                snprintf(name, sizeof(name), "%s %u:%u", site.function, site.line, site.col);
+            } else
+                snprintf(name, sizeof(name), "%s", by_site ? "main" : totals[i].function ? totals[i].function : "builtin");
+            fprintf(report, "%-32s %12llu %16llu %6.2f%% %16llu\n", name, (unsigned long long)totals[i].calls,
+                (unsigned long long)totals[i].self_cycles, 100 * totals[i].self_cycles / all_cycles,
+                (unsigned long long)totals[i].cycles);
+        }
+        fputc('\n', report);
+    }
+    free(totals);
+    fclose(report);
+}
+
+// Record the function that was just called. Main starts the profile.
+static inline void kin_profile_function(const char* function) {
+    if (kin_call_stack_len) {
+        kin_profile_resolve(kin_call_stack_len - 1, function);
+    } else if (!kin_profile_node_count) {
+        kin_profile_new_node(0, 0, function);
+        kin_profile_nodes[0].calls = 1;
+        kin_profile_start = kin_cycles();
+        atexit(kin_profile_report);
+    }
+}
+
+static inline void kin_profile_enter() {
+    kin_profile_calls[kin_call_stack_len] = (KinProfileCall) { 0, kin_cycles(), 0 };
+}
+
+static inline void kin_profile_exit() {
+    size_t depth = kin_call_stack_len - 1;
+    uint64_t elapsed = kin_cycles() - kin_profile_calls[depth].start;
+    KinProfileNode* node = &kin_profile_nodes[kin_profile_resolve(depth, NULL)];
+    node->self_cycles += elapsed - kin_profile_calls[depth].child_cycles;
+    if (--node->active == 0) node->cycles += elapsed;
+    if (depth)
+        kin_profile_calls[depth - 1].child_cycles += elapsed;
+    else
+        kin_profile_main_child_cycles += elapsed;
+}
+
+#define kin_enter_frame(function) kin_profile_function(function)
+
+#else
+
+#define kin_enter_frame(function)
+
+#endif
+
+#ifdef KIN_STATS
+kin_fn void kin_stats_call_stack(bool reallocated);
+#endif
+
+#ifdef KIN_SHARD
+void kin_push_call_stack(uint32_t site);
+void kin_pop_call_stack();
+void kin_print_call_stack();
+#else
+kin_fn void kin_push_call_stack(uint32_t site) {
+    size_t new_len = kin_call_stack_len + 1;
+    bool reallocated = new_len >= kin_call_stack_capacity;
+    if (reallocated) {
+        kin_call_stack_capacity = kin_call_stack_capacity == 0 ? 1 : kin_call_stack_capacity * 2;
+        kin_call_stack = (uint32_t*)realloc(kin_call_stack, kin_call_stack_capacity * sizeof(uint32_t));
+#ifdef KIN_PROFILE
+        kin_profile_calls = (KinProfileCall*)realloc(kin_profile_calls, kin_call_stack_capacity * sizeof(KinProfileCall));
+#endif
+    }
+#ifdef KIN_PROFILE
+    kin_profile_enter();
+#endif
+    kin_call_stack[kin_call_stack_len] = site;
+    kin_call_stack_len = new_len;
+#ifdef KIN_STATS
+    kin_stats_call_stack(reallocated);
+#endif
+}
+
+kin_fn void kin_pop_call_stack() {
+#ifdef KIN_PROFILE
+    kin_profile_exit();
+#endif
+    kin_call_stack_len -= 1;
+}
+
+kin_fn void kin_print_call_stack() {
+    for (int i = kin_call_stack_len - 1; i >= 0; i--) {
+        KinCallSite site = kin_call_sites[kin_call_stack[i]];
+        fprintf(kin_output(), "at %s %u:%u\n", site.function, site.line, site.col);
+    }
+}
+#endif
+
+#endif
+
+// Shards leave the report to the unit that holds the runtime
+#if defined(KIN_BENCH) && !defined(KIN_SHARD)
+
+// With KIN_BENCH, the peak resident set size is written to stderr at exit for kin bench
+#include <sys/resource.h>
+
+static void kin_bench_report() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    // macOS reports bytes instead of KiB
+    usage.ru_maxrss /= 1024;
+#endif
+    fprintf(stderr, "kin-bench-rss %ld\n", (long)usage.ru_maxrss);
+}
+
+__attribute__((constructor)) static void kin_bench_start() {
+    atexit(kin_bench_report);
+}
+
+#endif
+
+#ifdef KIN_SHARD
+void kin_flush();
+#else
+kin_fn void kin_flush() {
+    fwrite(kin_out, 1, kin_out_len, kin_output());
+    kin_out_len = 0;
+    fflush(kin_output());
+}
+#endif
+
+// Make room for at least len bytes in the output buffer
+static inline void kin_out_reserve(size_t len) {
+    if (kin_out_len + len > KIN_OUT_SIZE) kin_flush();
+}
+
+static inline void kin_write(const char* s, size_t len) {
+    kin_out_reserve(len);
+    if (len > KIN_OUT_SIZE) {
+        fwrite(s, 1, len, kin_output());
+        return;
+    }
+    memcpy(kin_out + kin_out_len, s, len);
+    kin_out_len += len;
+}
+
+#define kin_write_lit(s) kin_write(s, sizeof(s) - 1)
+
+// Write the decimal digits of an integer
+static inline void kin_write_uint(unsigned long n) {
+    char digits[20];
+    char* start = digits + sizeof(digits);
+    do {
+        *--start = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    kin_write(start, digits + sizeof(digits) - start);
+}
+
+static inline void kin_write_int(long i) {
+    if (i < 0) {
+        kin_write_lit("-");
+        kin_write_uint(0ul - (unsigned long)i);
+    } else {
+        kin_write_uint(i);
+    }
+}
+
+static const uint64_t kin_pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+};
+
+// Write a real with the fewest digits that read back as the same value. Most
+// reals are a 53 bit integer scaled by a power of ten, and both are exact
+// doubles, so a correctly rounded division checks a candidate. Other values
+// fall back to trying each printf precision.
+#ifdef KIN_SHARD
+void kin_write_real(double x);
+#else
+kin_fn void kin_write_real(double x) {
+    double ax = fabs(x);
+    if (ax < 9007199254740992.0) {
+        for (int k = 0; k < 18; k++) {
+            double scaled = ax * (double)kin_pow10[k];
+            if (scaled >= 9007199254740992.0) break;
+            uint64_t d = (uint64_t)(scaled + 0.5);
+            if ((double)d / (double)kin_pow10[k] != ax) continue;
+            if (x < 0 && d) kin_write_lit("-");
+            kin_write_uint(d / kin_pow10[k]);
+            uint64_t frac = d % kin_pow10[k];
+            if (frac) {
+                char digits[18];
+                for (int i = k - 1; i >= 0; i--) {
+                    digits[i] = '0' + frac % 10;
+                    frac /= 10;
+                }
+                int len = k;
+                while (digits[len - 1] == '0') len--;
+                kin_write_lit(".");
+                kin_write(digits, len);
+            }
+            return;
+        }
+    }
+    kin_out_reserve(32);
+    for (int precision = 1; precision <= 17; precision++) {
+        int len = snprintf(kin_out + kin_out_len, 32, "%.*g", precision, x);
+        if (precision == 17 || x != x || strtod(kin_out + kin_out_len, NULL) == x) {
+            kin_out_len += len;
+            return;
+        }
+    }
+}
+#endif
+
+#define kin_return(...) kin_return_as(KinValue, __VA_ARGS__)
+
+#ifdef KIN_SHARD
+void kin_panic_impl(char* message);
+#else
+kin_fn void kin_panic_impl(char* message) {
+#ifdef KIN_PARALLEL
+    pthread_mutex_lock(&kin_panic_lock);
+#endif
+    kin_flush();
+    fprintf(kin_output(), "%s\n", message);
+    kin_print_call_stack();
+#ifdef KIN_EMBED
+    // Return to the entry point, which reports the panic to the host
+    fflush(kin_output());
+    longjmp(*kin_rt->panic, 1);
+#else
+    exit(EXIT_FAILURE);
+#endif
+}
+#endif
+
+// The type of a byte
+typedef unsigned char byte;
+
+// The Kin string representation
+typedef struct KinString {
+    char* s;
+    size_t len;
+} KinString;
+
+// Set in the length of a string whose pointer is its entry in the intern table,
+// so two interned strings are equal exactly when their pointers are
+#define KIN_INTERNED 0x80000000u
+// Set in the length of a string whose chars are at the start of a KinStrBuf
+#define KIN_BUILT 0x40000000u
+#define KIN_STR_FLAGS (KIN_INTERNED | KIN_BUILT)
+
+// String kernels compare a vector of bytes at once. A comparison gives a mask
+// with KIN_SIMD_LANE_BITS bits set for each byte that matches. The
+// instruction set is chosen at compile time, so building with -march=native
+// picks up AVX2 where it is available.
+#if defined(__AVX2__)
+
+#define KIN_SIMD_WIDTH 32
+#define KIN_SIMD_LANE_BITS 1
+#define KIN_SIMD_FULL 0xffffffffull
+
+static inline uint64_t kin_simd_eq(const char* a, const char* b) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+static inline uint64_t kin_simd_pair(const char* a, byte x, const char* b, byte y) {
+    __m256i va = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a), _mm256_set1_epi8(x));
+    __m256i vb = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)b), _mm256_set1_epi8(y));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(va, vb));
+}
+
+#elif defined(__SSE2__)
+
+#define KIN_SIMD_WIDTH 16
+#define KIN_SIMD_LANE_BITS 1
+#define KIN_SIMD_FULL 0xffffull
+
+static inline uint64_t kin_simd_eq(const char* a, const char* b) {
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+
+static inline uint64_t kin_simd_pair(const char* a, byte x, const char* b, byte y) {
+    __m128i va = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_set1_epi8(x));
+    __m128i vb = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)b), _mm_set1_epi8(y));
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(va, vb));
+}
+
+#elif defined(__ARM_NEON)
+
+// NEON has no movemask, so each byte of the comparison is narrowed to a nibble
+#define KIN_SIMD_WIDTH 16
+#define KIN_SIMD_LANE_BITS 4
+#define KIN_SIMD_FULL 0xffffffffffffffffull
+
+static inline uint64_t kin_simd_mask(uint8x16_t eq) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+
+static inline uint64_t kin_simd_eq(const char* a, const char* b) {
+    return kin_simd_mask(vceqq_u8(vld1q_u8((const uint8_t*)a), vld1q_u8((const uint8_t*)b)));
+}
+
+static inline uint64_t kin_simd_pair(const char* a, byte x, const char* b, byte y) {
+    uint8x16_t va = vceqq_u8(vld1q_u8((const uint8_t*)a), vdupq_n_u8(x));
+    uint8x16_t vb = vceqq_u8(vld1q_u8((const uint8_t*)b), vdupq_n_u8(y));
+    return kin_simd_mask(vandq_u8(va, vb));
+}
+
+#endif
+
+// Get the index of the first byte at which two buffers differ, or len if they are equal
+static inline size_t kin_mem_mismatch(const char* a, const char* b, size_t len) {
+    size_t i = 0;
+#ifdef KIN_SIMD_WIDTH
+    for (; i + KIN_SIMD_WIDTH <= len; i += KIN_SIMD_WIDTH) {
+        uint64_t diff = ~kin_simd_eq(a + i, b + i) & KIN_SIMD_FULL;
+        if (diff) return i + __builtin_ctzll(diff) / KIN_SIMD_LANE_BITS;
+    }
+#endif
+    for (; i < len; i++)
+        if (a[i] != b[i]) return i;
+    return len;
+}
+
+// Order two buffers by their bytes, then by their lengths
+static inline int kin_mem_order(const char* a, size_t a_len, const char* b, size_t b_len) {
+    size_t len = min(a_len, b_len);
+    size_t i = kin_mem_mismatch(a, b, len);
+    if (i < len) return (byte)a[i] < (byte)b[i] ? -1 : 1;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Get the index of the first occurrence of a needle in a haystack, or -1 if there is none.
+// Candidates are positions where both the first and last bytes of the needle match.
+static inline long kin_mem_find(const char* hay, size_t hay_len, const char* needle, size_t needle_len) {
+    if (needle_len == 0) return 0;
+    if (needle_len > hay_len) return -1;
+    size_t last = hay_len - needle_len;
+    size_t i = 0;
+#ifdef KIN_SIMD_WIDTH
+    byte first_byte = needle[0];
+    byte last_byte = needle[needle_len - 1];
+    for (; i + KIN_SIMD_WIDTH <= last + 1; i += KIN_SIMD_WIDTH) {
+        uint64_t mask = kin_simd_pair(hay + i, first_byte, hay + i + needle_len - 1, last_byte);
+        while (mask) {
+            size_t j = i + __builtin_ctzll(mask) / KIN_SIMD_LANE_BITS;
+            if (kin_mem_mismatch(hay + j, needle, needle_len) == needle_len) return j;
+            mask &= ~((((uint64_t)1 << KIN_SIMD_LANE_BITS) - 1) << (j - i) * KIN_SIMD_LANE_BITS);
+        }
+    }
+#endif
+    for (; i <= last; i++)
+        if (hay[i] == needle[0] && kin_mem_mismatch(hay + i, needle, needle_len) == needle_len) return i;
+    return -1;
+}
+
+// Kin types
+typedef enum KinType {
+    Nil,
+    Bool,
+    Int,
+    Real,
+    String,
+    Function,
+    Closure,
+    Error,
+    List,
+    Map,
+    Seq,
+} KinType;
+
+static char* kin_type_names[] = {
+    "nil",
+    "bool",
+    "int",
+    "real",
+    "string",
+    "function",
+    "function",
+    "error",
+    "list",
+    "map",
+    "seq",
+};
+
+#define KIN_TYPE_COUNT (Seq + 1)
+
+// With KIN_STATS, the runtime counts dynamic and direct calls, operator calls by
+// operator and operand types, the call stack's growth, and the bytes allocated for
+// each type of value. The counts are written to stderr at exit, and also when the
+// program gets SIGUSR1, at its next call or operator.
+#ifdef KIN_STATS
+
+#ifdef KIN_EMBED
+#error "KIN_STATS reports when the process exits, so it cannot be used with KIN_EMBED"
+#endif
+
+// The operators that are counted, named after their functions
+enum {
+    kin_add_stat,
+    kin_sub_stat,
+    kin_mul_stat,
+    kin_div_stat,
+    kin_rem_stat,
+    kin_lt_stat,
+    kin_le_stat,
+    kin_gt_stat,
+    kin_ge_stat,
+    kin_eq_stat,
+    kin_neq_stat,
+    KIN_STAT_OPS,
+};
+
+static const char* kin_stat_op_names[] = { "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=" };
+
+// The slot of the bytes of the nodes that hold moms and dads, after those of each type
+#define KIN_STAT_NODES KIN_TYPE_COUNT
+
+typedef struct KinStats {
+    // Calls through values, by whether the callee is a function or a closure
+    uint64_t function_calls;
+    uint64_t closure_calls;
+    // Calls made directly to statically known functions
+    uint64_t direct_calls;
+    uint64_t ops[KIN_STAT_OPS][KIN_TYPE_COUNT][KIN_TYPE_COUNT];
+    uint64_t peak_call_stack;
+    uint64_t call_stack_reallocs;
+    uint64_t bytes[KIN_TYPE_COUNT + 1];
+    uint64_t arena_chunk_bytes;
+} KinStats;
+
+kin_global(KinStats kin_stats, { 0 });
+kin_global(volatile sig_atomic_t kin_stats_requested, 0);
+
+// Tasks on other threads count into the same stats
+#ifdef KIN_PARALLEL
+#define kin_stat_add(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#define kin_stat_add(counter, n) ((counter) += (n))
+#endif
+
+// Write the report if it was requested. Every call and operator checks, so a loop of
+// direct calls or of tail calls that only do arithmetic still reports.
+#define kin_stats_poll() (kin_stats_requested ? kin_stats_report() : (void)0)
+
+#define kin_stats_op(f, a, b) (kin_stat_add(kin_stats.ops[f## _stat][kin_unlink(*(a)).type][kin_unlink(*(b)).type], 1), kin_stats_poll())
+#define kin_stats_alloc(type, size) kin_stat_add(kin_stats.bytes[type], (size))
+#define kin_stats_direct_call() (kin_stat_add(kin_stats.direct_calls, 1), kin_stats_poll())
+
+#ifdef KIN_SHARD
+void kin_stats_report();
+void kin_stats_start();
+void kin_stats_call_stack(bool reallocated);
+#else
+kin_fn void kin_stats_report() {
+    kin_stats_requested = 0;
+    FILE* out = stderr;
+    fprintf(out, "\nKin stats:\n");
+    fprintf(out, "%-24s %16llu\n", "function calls", (unsigned long long)kin_stats.function_calls);
+    fprintf(out, "%-24s %16llu\n", "closure calls", (unsigned long long)kin_stats.closure_calls);
+    fprintf(out, "%-24s %16llu\n", "direct calls", (unsigned long long)kin_stats.direct_calls);
+    fprintf(out, "%-24s %16llu\n", "peak call stack", (unsigned long long)kin_stats.peak_call_stack);
+    fprintf(out, "%-24s %16llu\n", "call stack reallocs", (unsigned long long)kin_stats.call_stack_reallocs);
+    fprintf(out, "\n%-24s %16s\n", "operator", "calls");
+    for (int op = 0; op < KIN_STAT_OPS; op++)
+        for (int a = 0; a < KIN_TYPE_COUNT; a++)
+            for (int b = 0; b < KIN_TYPE_COUNT; b++) {
+                uint64_t count = kin_stats.ops[op][a][b];
+                if (!count) continue;
+                char name[64];
+                snprintf(name, sizeof(name), "%s %s %s", kin_type_names[a], kin_stat_op_names[op], kin_type_names[b]);
+                fprintf(out, "%-24s %16llu\n", name, (unsigned long long)count);
+            }
+    fprintf(out, "\n%-24s %16s\n", "allocated for", "bytes");
+    for (int type = 0; type <= KIN_STAT_NODES; type++)
+        if (kin_stats.bytes[type])
+            fprintf(out, "%-24s %16llu\n", type == KIN_STAT_NODES ? "nodes" : kin_type_names[type],
+                (unsigned long long)kin_stats.bytes[type]);
+    fprintf(out, "%-24s %16llu\n", "arena chunks", (unsigned long long)kin_stats.arena_chunk_bytes);
+}
+
+// The report cannot be written from a signal handler, so it is only requested there
+static void kin_stats_signal(int signal) {
+    (void)signal;
+    kin_stats_requested = 1;
+}
+
+kin_fn void kin_stats_start() {
+    atexit(kin_stats_report);
+#ifdef SIGUSR1
+    signal(SIGUSR1, kin_stats_signal);
+#endif
+}
+
+// Count the call stack's growth. Called after a push.
+kin_fn void kin_stats_call_stack(bool reallocated) {
+    if (reallocated) kin_stat_add(kin_stats.call_stack_reallocs, 1);
+#ifdef KIN_PARALLEL
+    uint64_t peak = __atomic_load_n(&kin_stats.peak_call_stack, __ATOMIC_RELAXED);
+    while (kin_call_stack_len > peak
+        && !__atomic_compare_exchange_n(&kin_stats.peak_call_stack, &peak, kin_call_stack_len, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+    if (kin_call_stack_len > kin_stats.peak_call_stack) kin_stats.peak_call_stack = kin_call_stack_len;
+#endif
+}
+#endif
+
+// Count a call through a value, and write the report if it was requested
+static inline void kin_stats_call(KinType type) {
+    if (type == Closure) kin_stat_add(kin_stats.closure_calls, 1);
+    else kin_stat_add(kin_stats.function_calls, 1);
+    kin_stats_poll();
+}
+
+#else
+
+#define kin_stats_op(f, a, b) ((void)0)
+#define kin_stats_alloc(type, size) ((void)0)
+#define kin_stats_direct_call() ((void)0)
+#define kin_stats_call(type) ((void)0)
+#define kin_stats_start() ((void)0)
+
+#endif
+
+// Foward declarations
+
+typedef struct KinValue KinValue;
+
+// The function pointer type for regular Kin functions
+typedef KinValue(*KinFn)(uint8_t, KinValue* args);
+// The function pointer type for Kin closures
+typedef KinValue(*KinClosureFn)(uint8_t, KinValue* args, KinValue* captures);
+
+// A Kin closure
+typedef struct KinFunction {
+    KinValue* captures;
+    KinClosureFn f;
+} KinFunction;
+
+// A position in the node arena that can be released back to
+typedef struct KinArenaMark {
+    KinArenaChunk* chunk;
+    size_t used;
+} KinArenaMark;
+
+#define KIN_ARENA_CHUNK_SIZE 65536
+
+#ifdef KIN_SHARD
+void kin_arena_grow(size_t size);
+#else
+kin_fn void kin_arena_grow(size_t size) {
+    KinArenaChunk* chunk = kin_arena_spare;
+    if (chunk && chunk->capacity >= size) {
+        kin_arena_spare = NULL;
+    } else {
+        size_t capacity = kin_arena ? kin_arena->capacity * 2 : KIN_ARENA_CHUNK_SIZE;
+        while (capacity < size) capacity *= 2;
+        chunk = (KinArenaChunk*)malloc(sizeof(KinArenaChunk) + capacity);
+        chunk->capacity = capacity;
+#ifdef KIN_STATS
+        kin_stat_add(kin_stats.arena_chunk_bytes, sizeof(KinArenaChunk) + capacity);
+#endif
+    }
+    chunk->prev = kin_arena;
+    chunk->used = 0;
+    kin_arena = chunk;
+}
+#endif
+
+// Allocate memory in the node arena
+static inline void* kin_arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!kin_arena || kin_arena->used + size > kin_arena->capacity) kin_arena_grow(size);
+    void* ptr = (char*)(kin_arena + 1) + kin_arena->used;
+    kin_arena->used += size;
+    return ptr;
+}
+
+// Allocate memory in the node arena for a type of value, which KIN_STATS counts
+#define kin_alloc(type, size) (kin_stats_alloc(type, size), kin_arena_alloc(size))
+
+static inline KinArenaMark kin_arena_mark() {
+    return (KinArenaMark) { kin_arena, kin_arena ? kin_arena->used : 0 };
+}
+
+// Free everything allocated in the node arena since the mark was taken
+static inline void kin_arena_release(KinArenaMark mark) {
+    while (kin_arena != mark.chunk) {
+        KinArenaChunk* prev = kin_arena->prev;
+        if (kin_arena_spare) free(kin_arena);
+        else kin_arena_spare = kin_arena;
+        kin_arena = prev;
+    }
+    if (kin_arena) kin_arena->used = mark.used;
+}
+
+// Return from a function after releasing the nodes it allocated
+#define kin_return_release_as(type, mark, ...) do { \
+    type kin_released = (__VA_ARGS__); \
+    kin_arena_release(mark); \
+    kin_return_as(type, kin_released); \
+} while (0)
+#define kin_return_release(mark, ...) kin_return_release_as(KinValue, mark, __VA_ARGS__)
+
+#ifdef KIN_COMPACT
+
+// With KIN_COMPACT, a value is 16 bytes: the type, a string length, and an
+// 8 byte payload. A closure points to its function and captures, and a value
+// with a mom or dad is boxed into a KinLinked node.
+
+typedef struct KinLinked KinLinked;
+
+// The data of a Kin value
+typedef union KinData {
+    bool Bool;
+    unsigned long Nat;
+    long Int;
+    double Real;
+    char* String;
+    KinFn Function;
+    KinFunction* Closure;
+    struct KinValue* Error;
+    struct KinList* List;
+    struct KinMap* Map;
+    struct KinSeq* Seq;
+    KinLinked* Linked;
+} KinData;
+
+// A kin value with a type and data
+struct KinValue {
+    KinType type;
+    uint32_t len;
+    KinData data;
+};
+
+// A value with its mom and dad
+struct KinLinked {
+    KinValue head;
+    KinValue* mom;
+    KinValue* dad;
+};
+
+// Set in the type of a value that is boxed into a KinLinked node
+#define KIN_LINKED 0x80
+
+#define new_val(_type, ...) (KinValue) { .type = _type, .data = {._type = __VA_ARGS__} }
+#define new_closure(function, caps) new_val(Closure, &(KinFunction) { .f = function, .captures = caps })
+#define new_env_closure(env) new_val(Closure, &(env)->function)
+#define new_string(s, l) (KinValue) { .type = String, .len = l, .data = { .String = s } }
+
+#define kin_str_s(val) (val).data.String
+#define kin_str_len(val) ((val).len & ~KIN_STR_FLAGS)
+#define kin_str_interned(val) ((val).len & KIN_INTERNED)
+#define kin_str_built(val) ((val).len & KIN_BUILT)
+#define kin_closure(val) (*(val).data.Closure)
+#define kin_unlink(val) ((val).type & KIN_LINKED ? (val).data.Linked->head : (val))
+#define kin_mom_of(val) ((val).type & KIN_LINKED ? (val).data.Linked->mom : NULL)
+#define kin_dad_of(val) ((val).type & KIN_LINKED ? (val).data.Linked->dad : NULL)
+
+// Box a value into a node with the given mom and dad
+#ifdef KIN_SHARD
+KinValue kin_link(KinValue val, KinValue* mom, KinValue* dad, KinLinked* node);
+#else
+kin_fn KinValue kin_link(KinValue val, KinValue* mom, KinValue* dad, KinLinked* node) {
+    node->head = kin_unlink(val);
+    node->mom = mom;
+    node->dad = dad;
+    return (KinValue) { .type = node->head.type | KIN_LINKED, .data = { .Linked = node } };
+}
+#endif
+
+#define kin_set_mom(val, m) ((val) = kin_link(val, m, kin_dad_of(val), (KinLinked*)kin_alloc(KIN_STAT_NODES, sizeof(KinLinked))))
+#define kin_set_dad(val, d) ((val) = kin_link(val, kin_mom_of(val), d, (KinLinked*)kin_alloc(KIN_STAT_NODES, sizeof(KinLinked))))
+
+#else
+
+// The data of a Kin value
+typedef union KinData {
+    bool Bool;
+    unsigned long Nat;
+    long Int;
+    double Real;
+    KinString String;
+    KinFn Function;
+    KinFunction Closure;
+    struct KinValue* Error;
+    struct KinList* List;
+    struct KinMap* Map;
+    struct KinSeq* Seq;
+} KinData;
+
+// A kin value with a type and data
+struct KinValue {
+    KinType type;
+    KinData data;
+    KinValue* mom;
+    KinValue* dad;
+};
+
+#define new_val(_type, ...) (KinValue) { .type = _type, .data = {._type = __VA_ARGS__}, .mom = NULL, .dad = NULL }
+#define new_closure(function, caps) new_val(Closure, { .f = function, .captures = caps })
+#define new_env_closure(env) new_val(Closure, (env)->function)
+#define new_kin_string(string, l) (KinString) { .s = string, .len = l }
+#define new_string(s, len) new_val(String, new_kin_string(s, len))
+
+#define kin_str_s(val) (val).data.String.s
+#define kin_str_len(val) ((val).data.String.len & ~(size_t)KIN_STR_FLAGS)
+#define kin_str_interned(val) ((val).data.String.len & KIN_INTERNED)
+#define kin_str_built(val) ((val).data.String.len & KIN_BUILT)
+#define kin_closure(val) (val).data.Closure
+#define kin_unlink(val) (val)
+#define kin_mom_of(val) (val).mom
+#define kin_dad_of(val) (val).dad
+#define kin_set_mom(val, m) ((val).mom = (m))
+#define kin_set_dad(val, d) ((val).dad = (d))
+
+#endif
+
+#define new_bool(b) new_val(Bool, b)
+#define new_int(i) new_val(Int, i)
+#define new_real(i) new_val(Real, i)
+#define new_function(f) new_val(Function, f)
+
+// The nil Kin value
+static KinValue KIN_NIL = { .type = Nil };
+// The true Kin value
+static KinValue KIN_TRUE = new_bool(true);
+// The false Kin value
+static KinValue KIN_FALSE = new_bool(false);
+
+// Copy a value into a node in the arena
+static inline KinValue* kin_node(KinValue val) {
+    KinValue* node = (KinValue*)kin_alloc(KIN_STAT_NODES, sizeof(KinValue));
+    *node = val;
+    return node;
+}
+
+// Give a value a copy of another as its mom or dad. With KIN_COMPACT, the copy is
+// packed into one allocation with the value's own node.
+#ifdef KIN_COMPACT
+static inline KinValue kin_with_parent(KinValue val, KinValue parent, bool mom) {
+    KinLinked* node = (KinLinked*)kin_alloc(KIN_STAT_NODES, sizeof(KinLinked) + sizeof(KinValue));
+    KinValue* copy = (KinValue*)(node + 1);
+    *copy = parent;
+    return mom ? kin_link(val, copy, kin_dad_of(val), node) : kin_link(val, kin_mom_of(val), copy, node);
+}
+#else
+static inline KinValue kin_with_parent(KinValue val, KinValue parent, bool mom) {
+    if (mom) val.mom = kin_node(parent);
+    else val.dad = kin_node(parent);
+    return val;
+}
+#endif
+#define kin_with_mom(val, m) kin_with_parent(val, m, true)
+#define kin_with_dad(val, d) kin_with_parent(val, d, false)
+
+// A closure's function and captured values in one allocation
+typedef struct KinEnv {
+    KinFunction function;
+    KinValue captures[];
+} KinEnv;
+
+// Allocate the environment of a closure that may outlive the function that creates it
+static inline KinEnv* kin_new_env(KinClosureFn f, size_t len) {
+    KinEnv* env = (KinEnv*)kin_alloc(Closure, sizeof(KinEnv) + len * sizeof(KinValue));
+    env->function.f = f;
+    env->function.captures = env->captures;
+    return env;
+}
+
+// The buffer that the chars of strings built by concatenation are in. Adding to a string
+// whose chars end where the buffer's used chars do appends to the buffer in place, so
+// building a string one piece at a time takes amortized linear time. The strings that
+// share a buffer are all prefixes of its chars, so they are never changed.
+typedef struct KinStrBuf {
+    size_t used;
+    size_t capacity;
+    char chars[];
+} KinStrBuf;
+
+#define kin_str_buf(val) ((KinStrBuf*)(kin_str_s(val) - offsetof(KinStrBuf, chars)))
+
+// Claim the unused chars of a buffer after a string of the given length that ends where its
+// used chars do, which fails if another string was already appended there
+static inline bool kin_str_claim(KinStrBuf* buf, size_t used, size_t len) {
+#ifdef KIN_PARALLEL
+    return __atomic_compare_exchange_n(&buf->used, &used, len, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    if (buf->used != used) return false;
+    buf->used = len;
+    return true;
+#endif
+}
+
+// Concatenate two strings
+#ifdef KIN_SHARD
+KinValue kin_concat(KinValue a, KinValue b);
+#else
+kin_fn KinValue kin_concat(KinValue a, KinValue b) {
+    size_t a_len = kin_str_len(a), b_len = kin_str_len(b), len = a_len + b_len;
+    if (!b_len) return a;
+    if (!a_len) return b;
+    // The length shares its word with the KIN_BUILT and KIN_INTERNED flags
+    if (len >= KIN_BUILT) kin_panic_impl("Attempted to build a string that is too long");
+    if (kin_str_built(a)) {
+        KinStrBuf* buf = kin_str_buf(a);
+        if (buf->capacity - a_len >= b_len && kin_str_claim(buf, a_len, len)) {
+            memcpy(buf->chars + a_len, kin_str_s(b), b_len);
+            return new_string(buf->chars, len | KIN_BUILT);
+        }
+    }
+    // The buffer has room to at least double the string in place
+    size_t capacity = len < 32 ? 64 : len * 2;
+    KinStrBuf* buf = (KinStrBuf*)kin_alloc(String, sizeof(KinStrBuf) + capacity);
+    buf->used = len;
+    buf->capacity = capacity;
+    memcpy(buf->chars, kin_str_s(a), a_len);
+    memcpy(buf->chars + a_len, kin_str_s(b), b_len);
+    return new_string(buf->chars, len | KIN_BUILT);
+}
+#endif
+
+// Hash a string with FNV-1a. The transpiler hashes string literals the same way.
+static inline uint64_t kin_hash(const char* s, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (byte)s[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Find the entry of a string in the intern table, or the empty slot it belongs in
+static KinInterned* kin_intern_slot(uint64_t hash, const char* s, size_t len) {
+    size_t mask = kin_intern_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        KinInterned* entry = &kin_intern_table[i];
+        if (!entry->s || (entry->hash == hash && entry->len == len && memcmp(entry->s, s, len) == 0))
+            return entry;
+    }
+}
+
+#ifdef KIN_SHARD
+void kin_intern_grow();
+#else
+kin_fn void kin_intern_grow() {
+    KinInterned* old = kin_intern_table;
+    size_t old_capacity = kin_intern_capacity;
+    kin_intern_capacity = old_capacity ? old_capacity * 2 : 64;
+    kin_intern_table = (KinInterned*)calloc(kin_intern_capacity, sizeof(KinInterned));
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].s) *kin_intern_slot(old[i].hash, old[i].s, old[i].len) = old[i];
+    free(old);
+}
+#endif
+
+// Get the entry of a string in the intern table, adding it if it is not there.
+// A new string is copied unless it is static. Either way, its hash is stored just
+// before its chars.
+static KinInterned* kin_intern_add(uint64_t hash, char* s, size_t len, bool copy) {
+    if ((kin_intern_len + 1) * 2 > kin_intern_capacity) kin_intern_grow();
+    KinInterned* entry = kin_intern_slot(hash, s, len);
+    if (!entry->s) {
+        if (copy) {
+            char* owned = (char*)malloc(sizeof(uint64_t) + len + 1) + sizeof(uint64_t);
+            kin_stats_alloc(String, sizeof(uint64_t) + len + 1);
+            ((uint64_t*)owned)[-1] = hash;
+            memcpy(owned, s, len);
+            owned[len] = '\0';
+            s = owned;
+        }
+        *entry = (KinInterned) { .hash = hash, .len = len, .s = s, .owned = copy };
+        kin_intern_len++;
+    }
+    return entry;
+}
+
+// Add the string literals of the program, which are already hashed, to the intern table
+#ifdef KIN_SHARD
+void kin_intern_literals(KinInterned* literals, size_t count);
+#else
+kin_fn void kin_intern_literals(KinInterned* literals, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        KinInterned* entry = kin_intern_add(literals[i].hash, literals[i].s, literals[i].len, false);
+        // Later runs of an embedded program find the same entries, so they do not write to the table
+        if (literals[i].s != entry->s) literals[i].s = entry->s;
+    }
+}
+#endif
+
+// Define the chars of a string literal for the literal table, which are stored after their hash
+#define kin_hashed_literal(name, h, lit) static struct { uint64_t hash; char chars[sizeof(lit)]; } name = { h, lit }
+
+// The string literal at an index in the literal table of the program
+#define kin_literal(i, len) new_string(kin_literals[i].s, (len) | KIN_INTERNED)
+
+// The hash of a string, which an interned string keeps just before its chars
+static inline uint64_t kin_str_hash(KinValue val) {
+    return kin_str_interned(val) ? ((uint64_t*)kin_str_s(val))[-1] : kin_hash(kin_str_s(val), kin_str_len(val));
+}
+
+// Intern a string so comparing it with other interned strings only compares pointers
+#ifdef KIN_SHARD
+KinValue kin_intern(uint8_t count, KinValue* args);
+KinValue kin_tree(KinValue left, KinValue middle, KinValue right);
+KinValue kin_head(KinValue val);
+KinValue kin_mom(uint8_t count, KinValue* args);
+KinValue kin_dad(uint8_t count, KinValue* args);
+void kin_binary_type_panic(char* message, KinType a, KinType b);
+void kin_unary_type_panic(char* message, KinType ty);
+KinValue kin_error(uint8_t count, KinValue* inner);
+KinValue kin_call_value(KinValue val, int count, KinValue* args);
+#else
+kin_fn KinValue kin_intern(uint8_t count, KinValue* args) {
+    KinValue val = count >= 1 ? args[0] : KIN_NIL;
+    KinValue head = kin_unlink(val);
+    if (head.type != String || kin_str_interned(head)) return val;
+    size_t len = kin_str_len(head);
+    KinInterned* entry = kin_intern_add(kin_hash(kin_str_s(head), len), kin_str_s(head), len, true);
+    KinValue interned = new_string(entry->s, len | KIN_INTERNED);
+    if (kin_mom_of(val)) kin_set_mom(interned, kin_mom_of(val));
+    if (kin_dad_of(val)) kin_set_dad(interned, kin_dad_of(val));
+    return interned;
+}
+
+// Create a tree, which is its middle value with the left as its mom and the right as its dad.
+// Both children are packed into one allocation, along with the middle's node with KIN_COMPACT.
+kin_fn KinValue kin_tree(KinValue left, KinValue middle, KinValue right) {
+#ifdef KIN_COMPACT
+    KinLinked* node = (KinLinked*)kin_alloc(KIN_STAT_NODES, sizeof(KinLinked) + 2 * sizeof(KinValue));
+    KinValue* children = (KinValue*)(node + 1);
+    children[0] = left;
+    children[1] = right;
+    return kin_link(middle, children, children + 1, node);
+#else
+    KinValue* children = (KinValue*)kin_alloc(KIN_STAT_NODES, 2 * sizeof(KinValue));
+    children[0] = left;
+    children[1] = right;
+    middle.mom = children;
+    middle.dad = children + 1;
+    return middle;
+#endif
+}
+
+kin_fn KinValue kin_head(KinValue val) {
+#ifdef KIN_COMPACT
+    return kin_unlink(val);
+#else
+    val.mom = NULL;
+    val.dad = NULL;
+    return val;
+#endif
+}
+
+kin_fn KinValue kin_mom(uint8_t count, KinValue* args) {
+    KinValue val = count >= 1 ? args[0] : KIN_NIL;
+    return kin_mom_of(val) ? *kin_mom_of(val) : KIN_NIL;
+}
+
+kin_fn KinValue kin_dad(uint8_t count, KinValue* args) {
+    KinValue val = count >= 1 ? args[0] : KIN_NIL;
+    return kin_dad_of(val) ? *kin_dad_of(val) : KIN_NIL;
+}
+
+kin_fn void kin_binary_type_panic(char* message, KinType a, KinType b) {
+    char str[256];
+    sprintf(str, message, kin_type_names[a], kin_type_names[b]);
+    kin_panic_impl(str);
+}
+
+kin_fn void kin_unary_type_panic(char* message, KinType ty) {
+    char str[256];
+    sprintf(str, message, kin_type_names[ty]);
+    kin_panic_impl(str);
+}
+
+// Create a new Kin error from a value
+kin_fn KinValue kin_error(uint8_t count, KinValue* inner) {
+    return new_val(Error, inner);
+}
+
+// Call a Kin function or closure value
+kin_fn KinValue kin_call_value(KinValue val, int count, KinValue* args) {
+    val = kin_unlink(val);
+    kin_stats_call(val.type);
+    switch (val.type) {
+    case Function:
+        return (*val.data.Function)(count, args);
+    case Closure:
+        return (*kin_closure(val).f)(count, args, kin_closure(val).captures);
+    default:
+        kin_unary_type_panic("Attempted to call %s value", val.type);
+        return KIN_NIL;
+    }
+}
+#endif
+
+// Unbox a value that was inferred to have a type the transpiler did not give it. Ints
+// and reals convert to each other when they are equal, and other values panic.
+static inline long kin_unbox_long(KinValue val) {
+    val = kin_unlink(val);
+    if (val.type == Int) return val.data.Int;
+    double r = val.data.Real;
+    if (val.type == Real && r > -9.2e18 && r < 9.2e18 && r == (double)(long)r) return (long)r;
+    kin_unary_type_panic("Expected an int, but got %s", val.type);
+    return 0;
+}
+
+static inline double kin_unbox_double(KinValue val) {
+    val = kin_unlink(val);
+    if (val.type == Real) return val.data.Real;
+    if (val.type == Int) return (double)val.data.Int;
+    kin_unary_type_panic("Expected a real, but got %s", val.type);
+    return 0;
+}
+
+static inline bool kin_unbox_bool(KinValue val) {
+    val = kin_unlink(val);
+    if (val.type == Bool) return val.data.Bool;
+    kin_unary_type_panic("Expected a bool, but got %s", val.type);
+    return false;
+}
+
+// A list is a persistent vector. Its values are in a trie of KIN_LIST_WIDTH wide nodes,
+// except for the last 1 to KIN_LIST_WIDTH, which are in a tail leaf so pushing and
+// popping rarely touch the trie. A changed list copies only the path to the change
+// and shares every other node with the list it came from.
+#define KIN_LIST_BITS 4
+#define KIN_LIST_WIDTH (1 << KIN_LIST_BITS)
+#define KIN_LIST_MASK (KIN_LIST_WIDTH - 1)
+
+typedef struct KinListLeaf {
+    // How many slots of a tail leaf are filled. Lists that share it may use fewer.
+    uint32_t used;
+    KinValue values[KIN_LIST_WIDTH];
+} KinListLeaf;
+
+// An inner node of the trie, whose children are leaves at the bottom level
+typedef struct KinListNode {
+    void* children[KIN_LIST_WIDTH];
+} KinListNode;
+
+typedef struct KinList {
+    size_t len;
+    // The shift of the index bits at the root's level, which is 0 when the root is a leaf
+    uint32_t shift;
+    uint32_t tail_len;
+    // NULL when every value is in the tail
+    void* root;
+    KinListLeaf* tail;
+} KinList;
+
+static KinList kin_empty_list = { 0 };
+
+#define new_list(list) new_val(List, list)
+
+// The leaf that holds an index, where the value is at the index's low bits
+static inline KinListLeaf* kin_list_leaf(KinList* list, size_t i) {
+    if (i >= list->len - list->tail_len) return list->tail;
+    void* node = list->root;
+    for (uint32_t shift = list->shift; shift > 0; shift -= KIN_LIST_BITS)
+        node = ((KinListNode*)node)->children[(i >> shift) & KIN_LIST_MASK];
+    return (KinListLeaf*)node;
+}
+
+#define kin_list_get(list, i) kin_list_leaf(list, i)->values[(i) & KIN_LIST_MASK]
+
+#ifdef KIN_SHARD
+KinList* kin_list_push(KinList* list, KinValue val);
+KinList* kin_list_pop(KinList* list);
+KinList* kin_list_set(KinList* list, size_t i, KinValue val);
+KinValue kin_list(uint8_t count, KinValue* args);
+KinValue kin_push(uint8_t count, KinValue* args);
+KinValue kin_pop(uint8_t count, KinValue* args);
+KinValue kin_set(uint8_t count, KinValue* args);
+KinValue kin_last(uint8_t count, KinValue* args);
+#else
+// Claim the next slot of a tail leaf for a list that uses the given number of its slots.
+// This fails if a list that shares the leaf has already filled the slot.
+static inline bool kin_list_claim(KinListLeaf* leaf, uint32_t used) {
+#ifdef KIN_PARALLEL
+    return __atomic_compare_exchange_n(&leaf->used, &used, used + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    if (leaf->used != used) return false;
+    leaf->used++;
+    return true;
+#endif
+}
+
+static KinListLeaf* kin_list_copy_leaf(KinListLeaf* leaf, uint32_t used) {
+    KinListLeaf* copy = (KinListLeaf*)kin_alloc(List, sizeof(KinListLeaf));
+    copy->used = used;
+    memcpy(copy->values, leaf->values, used * sizeof(KinValue));
+    return copy;
+}
+
+// Copy a node with the full leaf at an index added below it
+static void* kin_list_append_leaf(KinListNode* node, uint32_t shift, size_t i, KinListLeaf* leaf) {
+    KinListNode* copy = (KinListNode*)kin_alloc(List, sizeof(KinListNode));
+    if (node) *copy = *node;
+    else memset(copy, 0, sizeof(KinListNode));
+    size_t child = (i >> shift) & KIN_LIST_MASK;
+    copy->children[child] = shift == KIN_LIST_BITS
+        ? (void*)leaf
+        : kin_list_append_leaf((KinListNode*)copy->children[child], shift - KIN_LIST_BITS, i, leaf);
+    return copy;
+}
+
+// Copy a node without the last leaf below it, which is at an index. Returns NULL if nothing is left.
+static KinListNode* kin_list_drop_leaf(KinListNode* node, uint32_t shift, size_t i) {
+    size_t child = (i >> shift) & KIN_LIST_MASK;
+    void* dropped = shift == KIN_LIST_BITS
+        ? NULL
+        : kin_list_drop_leaf((KinListNode*)node->children[child], shift - KIN_LIST_BITS, i);
+    if (!dropped && child == 0) return NULL;
+    KinListNode* copy = (KinListNode*)kin_alloc(List, sizeof(KinListNode));
+    *copy = *node;
+    copy->children[child] = dropped;
+    return copy;
+}
+
+// Copy a node with the value at an index replaced
+static void* kin_list_set_in(void* node, uint32_t shift, size_t i, KinValue val) {
+    if (shift == 0) {
+        KinListLeaf* leaf = kin_list_copy_leaf((KinListLeaf*)node, KIN_LIST_WIDTH);
+        leaf->values[i & KIN_LIST_MASK] = val;
+        return leaf;
+    }
+    KinListNode* copy = (KinListNode*)kin_alloc(List, sizeof(KinListNode));
+    *copy = *(KinListNode*)node;
+    size_t child = (i >> shift) & KIN_LIST_MASK;
+    copy->children[child] = kin_list_set_in(copy->children[child], shift - KIN_LIST_BITS, i, val);
+    return copy;
+}
+
+// Add a value to the end of a list
+kin_fn KinList* kin_list_push(KinList* list, KinValue val) {
+    KinList* pushed = (KinList*)kin_alloc(List, sizeof(KinList));
+    *pushed = *list;
+    pushed->len++;
+    if (list->tail && list->tail_len < KIN_LIST_WIDTH) {
+        // The value goes in the tail leaf itself unless another list got its slot first
+        if (!kin_list_claim(list->tail, list->tail_len))
+            pushed->tail = kin_list_copy_leaf(list->tail, list->tail_len + 1);
+        pushed->tail->values[pushed->tail_len++] = val;
+        return pushed;
+    }
+    // A full tail moves into the trie, and the value starts a new tail
+    if (list->tail) {
+        size_t trie_len = list->len - KIN_LIST_WIDTH;
+        if (!list->root) {
+            pushed->root = list->tail;
+        } else if (trie_len == (size_t)KIN_LIST_WIDTH << list->shift) {
+            KinListNode grown = { .children = { list->root } };
+            pushed->shift += KIN_LIST_BITS;
+            pushed->root = kin_list_append_leaf(&grown, pushed->shift, trie_len, list->tail);
+        } else {
+            pushed->root = kin_list_append_leaf((KinListNode*)list->root, list->shift, trie_len, list->tail);
+        }
+    }
+    pushed->tail = (KinListLeaf*)kin_alloc(List, sizeof(KinListLeaf));
+    pushed->tail->used = 1;
+    pushed->tail->values[0] = val;
+    pushed->tail_len = 1;
+    return pushed;
+}
+
+// Remove the last value of a non-empty list
+kin_fn KinList* kin_list_pop(KinList* list) {
+    if (list->len == 1) return &kin_empty_list;
+    KinList* popped = (KinList*)kin_alloc(List, sizeof(KinList));
+    *popped = *list;
+    popped->len--;
+    if (--popped->tail_len > 0) return popped;
+    // The tail is empty, so the last leaf of the trie becomes the tail
+    size_t trie_len = popped->len - KIN_LIST_WIDTH;
+    popped->tail = kin_list_leaf(list, trie_len);
+    popped->tail_len = KIN_LIST_WIDTH;
+    if (trie_len == 0) {
+        popped->root = NULL;
+        popped->shift = 0;
+        return popped;
+    }
+    popped->root = kin_list_drop_leaf((KinListNode*)list->root, list->shift, trie_len);
+    // A root with one child is replaced by the child
+    while (popped->shift > 0 && trie_len <= (size_t)KIN_LIST_WIDTH << (popped->shift - KIN_LIST_BITS)) {
+        popped->root = ((KinListNode*)popped->root)->children[0];
+        popped->shift -= KIN_LIST_BITS;
+    }
+    return popped;
+}
+
+// Replace the value at an index of a list
+kin_fn KinList* kin_list_set(KinList* list, size_t i, KinValue val) {
+    KinList* set = (KinList*)kin_alloc(List, sizeof(KinList));
+    *set = *list;
+    if (i >= list->len - list->tail_len) {
+        set->tail = kin_list_copy_leaf(list->tail, list->tail_len);
+        set->tail->values[i & KIN_LIST_MASK] = val;
+    } else {
+        set->root = kin_list_set_in(list->root, list->shift, i, val);
+    }
+    return set;
+}
+
+// Get the list a value is, where nil is an empty list
+static KinList* kin_as_list(KinValue val, char* message) {
+    val = kin_unlink(val);
+    if (val.type == List) return val.data.List;
+    if (val.type != Nil) kin_unary_type_panic(message, val.type);
+    return &kin_empty_list;
+}
+
+// Get the index of a list that a value is, or -1 if it is out of range
+static long kin_list_index(KinList* list, KinValue val) {
+    val = kin_unlink(val);
+    if (val.type != Int) kin_unary_type_panic("Attempted to index a list with %s", val.type);
+    return val.data.Int >= 0 && (size_t)val.data.Int < list->len ? val.data.Int : -1;
+}
+
+// Create a list of the arguments
+kin_fn KinValue kin_list(uint8_t count, KinValue* args) {
+    KinList* list = &kin_empty_list;
+    for (uint8_t i = 0; i < count; i++) list = kin_list_push(list, args[i]);
+    return new_list(list);
+}
+
+// Add the arguments after the first to the end of the list that is the first
+kin_fn KinValue kin_push(uint8_t count, KinValue* args) {
+    KinList* list = kin_as_list(count >= 1 ? args[0] : KIN_NIL, "Attempted to push to %s");
+    for (uint8_t i = 1; i < count; i++) list = kin_list_push(list, args[i]);
+    return new_list(list);
+}
+
+// Remove the last value of a list
+kin_fn KinValue kin_pop(uint8_t count, KinValue* args) {
+    KinList* list = kin_as_list(count >= 1 ? args[0] : KIN_NIL, "Attempted to pop from %s");
+    if (list->len == 0) kin_panic_impl("Attempted to pop from an empty list");
+    return new_list(kin_list_pop(list));
+}
+
+// Replace the value at an index of a list
+kin_fn KinValue kin_set(uint8_t count, KinValue* args) {
+    KinList* list = kin_as_list(count >= 1 ? args[0] : KIN_NIL, "Attempted to index %s");
+    long i = kin_list_index(list, count >= 2 ? args[1] : KIN_NIL);
+    if (i < 0) kin_panic_impl("Attempted to set an index that is out of range");
+    return new_list(kin_list_set(list, (size_t)i, count >= 3 ? args[2] : KIN_NIL));
+}
+
+// Get the last value of a list, or nil if it is empty
+kin_fn KinValue kin_last(uint8_t count, KinValue* args) {
+    KinList* list = kin_as_list(count >= 1 ? args[0] : KIN_NIL, "Attempted to get the last value of %s");
+    return list->len ? list->tail->values[list->tail_len - 1] : KIN_NIL;
+}
+#endif
+
+// A map is a persistent hash array mapped trie. Each node has a slot for each value of the
+// next KIN_MAP_BITS bits of a key's hash, and stores only its used slots, packed in order:
+// first its entries and then its children. A changed map copies only the path to the
+// change. Keys whose hashes are equal all the way down share a collision node.
+#define KIN_MAP_BITS 5
+#define KIN_MAP_MASK ((1u << KIN_MAP_BITS) - 1)
+
+typedef struct KinMapEntry {
+    uint64_t hash;
+    KinValue key;
+    KinValue value;
+} KinMapEntry;
+
+typedef struct KinMapNode {
+    // The slots that hold entries and children
+    uint32_t entry_map;
+    uint32_t child_map;
+    // The number of entries of a collision node, which has no slots, or 0
+    uint32_t collisions;
+    KinMapEntry entries[];
+} KinMapNode;
+
+typedef struct KinMap {
+    size_t len;
+    KinMapNode* root;
+} KinMap;
+
+static KinMap kin_empty_map = { 0 };
+
+#define new_map(map) new_val(Map, map)
+
+#define kin_map_entry_count(node) ((node)->collisions ? (node)->collisions : (uint32_t)__builtin_popcount((node)->entry_map))
+#define kin_map_child_count(node) ((uint32_t)__builtin_popcount((node)->child_map))
+#define kin_map_children(node) ((KinMapNode**)((node)->entries + kin_map_entry_count(node)))
+// The position of a slot's entry or child among those of its node
+#define kin_map_index(map, bit) __builtin_popcount((map) & ((bit) - 1))
+#define kin_map_bit(hash, shift) (1u << (((hash) >> (shift)) & KIN_MAP_MASK))
+
+static inline uint64_t kin_mix_hash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+#ifdef KIN_SHARD
+uint64_t kin_hash_value(KinValue val);
+KinValue* kin_map_find(KinMap* map, uint64_t hash, KinValue key);
+KinMap* kin_map_insert(KinMap* map, uint64_t hash, KinValue key, KinValue value);
+KinMap* kin_map_remove(KinMap* map, uint64_t hash, KinValue key);
+void kin_map_print(KinMapNode* node, bool first);
+bool kin_map_includes(KinMapNode* node, KinMap* other);
+KinValue kin_insert(uint8_t count, KinValue* args);
+KinValue kin_remove(uint8_t count, KinValue* args);
+KinValue kin_get(uint8_t count, KinValue* args);
+KinValue kin_len(uint8_t count, KinValue* args);
+#else
+kin_fn bool kin_eq_impl(KinValue a, KinValue b);
+kin_fn KinValue kin_print(uint8_t count, KinValue* args);
+kin_fn uint64_t kin_hash_value(KinValue val);
+
+// Combine the hashes of the entries below a node in an order that does not depend on the trie
+static uint64_t kin_map_hash(KinMapNode* node) {
+    uint64_t hash = 0;
+    for (uint32_t i = 0; i < kin_map_entry_count(node); i++)
+        hash += kin_mix_hash(node->entries[i].hash + kin_hash_value(node->entries[i].value));
+    for (uint32_t i = 0; i < kin_map_child_count(node); i++) hash += kin_map_hash(kin_map_children(node)[i]);
+    return hash;
+}
+
+// Every int with a smaller magnitude than this is exactly a real
+#define KIN_EXACT_INT 9007199254740992l
+
+static inline uint64_t kin_real_hash(double r) {
+    uint64_t bits;
+    memcpy(&bits, &r, sizeof(bits));
+    return kin_mix_hash(bits);
+}
+
+// Hash a value so that values that kin_eq_impl finds equal have equal hashes
+kin_fn uint64_t kin_hash_value(KinValue val) {
+    val = kin_unlink(val);
+    switch (val.type) {
+    case Nil: return 0;
+    case Bool: return kin_mix_hash(1 + val.data.Bool);
+    case Int:
+        // An int is compared with a real after it is converted, and ints past 2^53 can
+        // round to the same real, so those hash like the real they convert to
+        if (val.data.Int > -KIN_EXACT_INT && val.data.Int < KIN_EXACT_INT) return kin_mix_hash((uint64_t)val.data.Int);
+        return kin_real_hash((double)val.data.Int);
+    case Real: {
+        // A real equal to an int that converts exactly hashes like the int
+        double r = val.data.Real;
+        if (r > -KIN_EXACT_INT && r < KIN_EXACT_INT && r == (double)(long)r) return kin_mix_hash((uint64_t)(long)r);
+        return kin_real_hash(r);
+    }
+    case String: return kin_str_hash(val);
+    case Function: return kin_mix_hash((uint64_t)(size_t)val.data.Function);
+    case Closure: return kin_mix_hash((uint64_t)(size_t)kin_closure(val).f);
+    case Error: return kin_mix_hash(kin_hash_value(*val.data.Error) + 3);
+    case List: {
+        uint64_t hash = 4;
+        for (size_t i = 0; i < val.data.List->len; i++)
+            hash = kin_mix_hash(hash + kin_hash_value(kin_list_get(val.data.List, i)));
+        return hash;
+    }
+    case Map: return val.data.Map->root ? kin_mix_hash(kin_map_hash(val.data.Map->root) + 5) : 5;
+    case Seq: return kin_mix_hash((uint64_t)(size_t)val.data.Seq + 6);
+    }
+    return 0;
+}
+
+static KinMapNode* kin_map_node(uint32_t entry_map, uint32_t child_map, uint32_t collisions) {
+    uint32_t entries = collisions ? collisions : (uint32_t)__builtin_popcount(entry_map);
+    KinMapNode* node = (KinMapNode*)kin_alloc(Map, sizeof(KinMapNode)
+        + entries * sizeof(KinMapEntry) + __builtin_popcount(child_map) * sizeof(KinMapNode*));
+    node->entry_map = entry_map;
+    node->child_map = child_map;
+    node->collisions = collisions;
+    return node;
+}
+
+// Copy a node with a slot changed to hold an entry, a child, or nothing if both are NULL
+static KinMapNode* kin_map_with_slot(KinMapNode* node, uint32_t bit, KinMapEntry* entry, KinMapNode* child) {
+    uint32_t entry_map = (node->entry_map & ~bit) | (entry ? bit : 0);
+    uint32_t child_map = (node->child_map & ~bit) | (child ? bit : 0);
+    KinMapNode* copy = kin_map_node(entry_map, child_map, 0);
+    uint32_t before = kin_map_index(node->entry_map, bit);
+    uint32_t after = __builtin_popcount(node->entry_map & ~(bit | (bit - 1)));
+    KinMapEntry* entries = copy->entries;
+    memcpy(entries, node->entries, before * sizeof(KinMapEntry));
+    if (entry) entries[before++] = *entry;
+    memcpy(entries + before, node->entries + kin_map_entry_count(node) - after, after * sizeof(KinMapEntry));
+    before = kin_map_index(node->child_map, bit);
+    after = __builtin_popcount(node->child_map & ~(bit | (bit - 1)));
+    KinMapNode** children = kin_map_children(copy);
+    memcpy(children, kin_map_children(node), before * sizeof(KinMapNode*));
+    if (child) children[before++] = child;
+    memcpy(children + before, kin_map_children(node) + kin_map_child_count(node) - after, after * sizeof(KinMapNode*));
+    return copy;
+}
+
+// Make a node for two entries whose hashes agree below a shift
+static KinMapNode* kin_map_pair(KinMapEntry* a, KinMapEntry* b, uint32_t shift) {
+    if (shift >= 64) {
+        KinMapNode* node = kin_map_node(0, 0, 2);
+        node->entries[0] = *a;
+        node->entries[1] = *b;
+        return node;
+    }
+    uint32_t a_bit = kin_map_bit(a->hash, shift), b_bit = kin_map_bit(b->hash, shift);
+    if (a_bit == b_bit) {
+        KinMapNode* node = kin_map_node(0, a_bit, 0);
+        kin_map_children(node)[0] = kin_map_pair(a, b, shift + KIN_MAP_BITS);
+        return node;
+    }
+    KinMapNode* node = kin_map_node(a_bit | b_bit, 0, 0);
+    node->entries[a_bit > b_bit] = *a;
+    node->entries[a_bit < b_bit] = *b;
+    return node;
+}
+
+// Find the value of a key in a map, or NULL if it is not there
+kin_fn KinValue* kin_map_find(KinMap* map, uint64_t hash, KinValue key) {
+    KinMapNode* node = map->root;
+    for (uint32_t shift = 0; node; shift += KIN_MAP_BITS) {
+        if (node->collisions) {
+            for (uint32_t i = 0; i < node->collisions; i++)
+                if (kin_eq_impl(node->entries[i].key, key)) return &node->entries[i].value;
+            return NULL;
+        }
+        uint32_t bit = kin_map_bit(hash, shift);
+        if (node->entry_map & bit) {
+            KinMapEntry* entry = &node->entries[kin_map_index(node->entry_map, bit)];
+            return entry->hash == hash && kin_eq_impl(entry->key, key) ? &entry->value : NULL;
+        }
+        node = node->child_map & bit ? kin_map_children(node)[kin_map_index(node->child_map, bit)] : NULL;
+    }
+    return NULL;
+}
+
+// Copy a node with an entry added or replaced below it. Sets added if the key was not there.
+static KinMapNode* kin_map_insert_in(KinMapNode* node, uint32_t shift, KinMapEntry* entry, bool* added) {
+    if (node->collisions) {
+        uint32_t i = 0;
+        while (i < node->collisions && !kin_eq_impl(node->entries[i].key, entry->key)) i++;
+        *added = i == node->collisions;
+        KinMapNode* copy = kin_map_node(0, 0, node->collisions + *added);
+        memcpy(copy->entries, node->entries, node->collisions * sizeof(KinMapEntry));
+        copy->entries[i] = *entry;
+        return copy;
+    }
+    uint32_t bit = kin_map_bit(entry->hash, shift);
+    if (node->entry_map & bit) {
+        KinMapEntry* existing = &node->entries[kin_map_index(node->entry_map, bit)];
+        if (existing->hash == entry->hash && kin_eq_impl(existing->key, entry->key)) {
+            *added = false;
+            return kin_map_with_slot(node, bit, entry, NULL);
+        }
+        // Two entries in one slot move into a child
+        *added = true;
+        return kin_map_with_slot(node, bit, NULL, kin_map_pair(existing, entry, shift + KIN_MAP_BITS));
+    }
+    if (node->child_map & bit) {
+        KinMapNode* child = kin_map_children(node)[kin_map_index(node->child_map, bit)];
+        return kin_map_with_slot(node, bit, NULL, kin_map_insert_in(child, shift + KIN_MAP_BITS, entry, added));
+    }
+    *added = true;
+    return kin_map_with_slot(node, bit, entry, NULL);
+}
+
+// Add a key and its value to a map, replacing any value it already has
+kin_fn KinMap* kin_map_insert(KinMap* map, uint64_t hash, KinValue key, KinValue value) {
+    KinMapEntry entry = { hash, key, value };
+    KinMap* inserted = (KinMap*)kin_alloc(Map, sizeof(KinMap));
+    if (!map->root) {
+        inserted->root = kin_map_node(kin_map_bit(hash, 0), 0, 0);
+        inserted->root->entries[0] = entry;
+        inserted->len = 1;
+        return inserted;
+    }
+    bool added;
+    inserted->root = kin_map_insert_in(map->root, 0, &entry, &added);
+    inserted->len = map->len + added;
+    return inserted;
+}
+
+// Copy a node without a key below it, or return the node itself if the key is not there.
+// Returns NULL if nothing would be left. A child left with one entry is replaced by the
+// entry, so that a map's shape only depends on its keys.
+static KinMapNode* kin_map_remove_in(KinMapNode* node, uint32_t shift, uint64_t hash, KinValue key) {
+    if (node->collisions) {
+        uint32_t i = 0;
+        while (i < node->collisions && !kin_eq_impl(node->entries[i].key, key)) i++;
+        if (i == node->collisions) return node;
+        if (node->collisions == 1) return NULL;
+        KinMapNode* copy = kin_map_node(0, 0, node->collisions - 1);
+        memcpy(copy->entries, node->entries, i * sizeof(KinMapEntry));
+        memcpy(copy->entries + i, node->entries + i + 1, (node->collisions - i - 1) * sizeof(KinMapEntry));
+        return copy;
+    }
+    uint32_t bit = kin_map_bit(hash, shift);
+    if (node->entry_map & bit) {
+        KinMapEntry* entry = &node->entries[kin_map_index(node->entry_map, bit)];
+        if (entry->hash != hash || !kin_eq_impl(entry->key, key)) return node;
+        if (node->entry_map == bit && !node->child_map) return NULL;
+        return kin_map_with_slot(node, bit, NULL, NULL);
+    }
+    if (!(node->child_map & bit)) return node;
+    KinMapNode* child = kin_map_children(node)[kin_map_index(node->child_map, bit)];
+    KinMapNode* removed = kin_map_remove_in(child, shift + KIN_MAP_BITS, hash, key);
+    if (removed == child) return node;
+    if (removed && !removed->child_map && kin_map_entry_count(removed) == 1)
+        return kin_map_with_slot(node, bit, &removed->entries[0], NULL);
+    if (!removed && node->child_map == bit && !node->entry_map) return NULL;
+    return kin_map_with_slot(node, bit, NULL, removed);
+}
+
+// Remove a key from a map
+kin_fn KinMap* kin_map_remove(KinMap* map, uint64_t hash, KinValue key) {
+    if (!map->root) return map;
+    KinMapNode* root = kin_map_remove_in(map->root, 0, hash, key);
+    if (root == map->root) return map;
+    if (!root) return &kin_empty_map;
+    KinMap* removed = (KinMap*)kin_alloc(Map, sizeof(KinMap));
+    removed->root = root;
+    removed->len = map->len - 1;
+    return removed;
+}
+
+// Print the entries below a node, after other entries unless first is set
+kin_fn void kin_map_print(KinMapNode* node, bool first) {
+    for (uint32_t i = 0; i < kin_map_entry_count(node); i++) {
+        if (!first) kin_write_lit(", ");
+        first = false;
+        kin_print(1, &node->entries[i].key);
+        kin_write_lit(": ");
+        kin_print(1, &node->entries[i].value);
+    }
+    for (uint32_t i = 0; i < kin_map_child_count(node); i++) {
+        kin_map_print(kin_map_children(node)[i], first);
+        first = false;
+    }
+}
+
+// Whether every entry below a node is in another map
+kin_fn bool kin_map_includes(KinMapNode* node, KinMap* other) {
+    for (uint32_t i = 0; i < kin_map_entry_count(node); i++) {
+        KinValue* value = kin_map_find(other, node->entries[i].hash, node->entries[i].key);
+        if (!value || !kin_eq_impl(*value, node->entries[i].value)) return false;
+    }
+    for (uint32_t i = 0; i < kin_map_child_count(node); i++)
+        if (!kin_map_includes(kin_map_children(node)[i], other)) return false;
+    return true;
+}
+
+// Get the map a value is, where nil is an empty map
+static KinMap* kin_as_map(KinValue val, char* message) {
+    val = kin_unlink(val);
+    if (val.type == Map) return val.data.Map;
+    if (val.type != Nil) kin_unary_type_panic(message, val.type);
+    return &kin_empty_map;
+}
+
+// Add keys and values, which follow the map in pairs, to a map
+kin_fn KinValue kin_insert(uint8_t count, KinValue* args) {
+    KinMap* map = kin_as_map(count >= 1 ? args[0] : KIN_NIL, "Attempted to insert into %s");
+    for (uint8_t i = 1; i < count; i += 2)
+        map = kin_map_insert(map, kin_hash_value(args[i]), args[i], i + 1 < count ? args[i + 1] : KIN_NIL);
+    return new_map(map);
+}
+
+// Remove the keys that follow a map from it
+kin_fn KinValue kin_remove(uint8_t count, KinValue* args) {
+    KinMap* map = kin_as_map(count >= 1 ? args[0] : KIN_NIL, "Attempted to remove from %s");
+    for (uint8_t i = 1; i < count; i++) map = kin_map_remove(map, kin_hash_value(args[i]), args[i]);
+    return new_map(map);
+}
+
+// Get the value of a key in a map or at an index of a list, or nil if it is not there
+kin_fn KinValue kin_get(uint8_t count, KinValue* args) {
+    KinValue val = kin_unlink(count >= 1 ? args[0] : KIN_NIL);
+    KinValue key = count >= 2 ? args[1] : KIN_NIL;
+    if (val.type == Map) {
+        KinValue* value = kin_map_find(val.data.Map, kin_hash_value(key), key);
+        return value ? *value : KIN_NIL;
+    }
+    KinList* list = kin_as_list(val, "Attempted to index %s");
+    long i = kin_list_index(list, key);
+    return i < 0 ? KIN_NIL : kin_list_get(list, (size_t)i);
+}
+
+// Get the length of a list, map, or string
+kin_fn KinValue kin_len(uint8_t count, KinValue* args) {
+    KinValue val = kin_unlink(count >= 1 ? args[0] : KIN_NIL);
+    if (val.type == String) return new_int((long)kin_str_len(val));
+    if (val.type == Map) return new_int((long)val.data.Map->len);
+    return new_int((long)kin_as_list(val, "Attempted to get the length of %s")->len);
+}
+#endif
+
+// Whether a value points to nothing, so it can outlive the nodes allocated while making it
+static inline bool kin_is_flat(KinValue val) {
+    if (kin_mom_of(val) || kin_dad_of(val)) return false;
+    switch (val.type) {
+    case Nil: case Bool: case Int: case Real: case Function: return true;
+    default: return false;
+    }
+}
+
+// A memoized function keeps the results of its calls in a cache of KIN_MEMO_SIZE slots, a power of 2,
+// which its first store allocates. The args of a call hash to a window of KIN_MEMO_PROBES
+// slots. A store into a full window evicts the first slot that has not been hit since the
+// last eviction passed over it, like a clock. Only values that point to nothing are kept,
+// since anything else may be in a released arena or belong to an embedded run that ended.
+#ifndef KIN_MEMO_SIZE
+#define KIN_MEMO_SIZE 4096
+#endif
+#define KIN_MEMO_PROBES 8
+#define KIN_MEMO_USED 1
+#define KIN_MEMO_HIT 2
+
+typedef struct KinMemo {
+    // For each slot, the result and then the args
+    KinValue* values;
+    uint64_t* hashes;
+    uint8_t* states;
+} KinMemo;
+
+#ifdef KIN_SHARD
+KinValue* kin_memo_find(KinMemo* memo, uint8_t arity, KinValue* args, uint64_t* hash);
+void kin_memo_store(KinMemo* memo, uint8_t arity, KinValue* args, uint64_t hash, KinValue result);
+#else
+// Whether two flat values are the same. This is stricter than kin_eq_impl, since a
+// function may return different results for 1 and 1.0.
+static inline bool kin_memo_same(KinValue a, KinValue b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+    case Bool: return a.data.Bool == b.data.Bool;
+    case Int: return a.data.Int == b.data.Int;
+    case Real: return memcmp(&a.data.Real, &b.data.Real, sizeof(double)) == 0;
+    case Function: return a.data.Function == b.data.Function;
+    default: return true;
+    }
+}
+
+// Find the cached result of a call. The hash of the args is set for kin_memo_store, or
+// to 0 if they cannot be cached.
+kin_fn KinValue* kin_memo_find(KinMemo* memo, uint8_t arity, KinValue* args, uint64_t* hash) {
+    uint64_t h = arity;
+    for (uint8_t i = 0; i < arity; i++) {
+        if (!kin_is_flat(args[i])) {
+            *hash = 0;
+            return NULL;
+        }
+        h = kin_mix_hash(h + kin_hash_value(args[i]));
+    }
+    *hash = h = h ? h : 1;
+    if (!memo->values) return NULL;
+    for (uint32_t i = 0; i < KIN_MEMO_PROBES; i++) {
+        size_t slot = (h + i) & (KIN_MEMO_SIZE - 1);
+        // Slots are never emptied, so the window ends at the first unused one
+        if (!(memo->states[slot] & KIN_MEMO_USED)) return NULL;
+        if (memo->hashes[slot] != h) continue;
+        KinValue* values = memo->values + slot * (arity + 1);
+        uint8_t j = 0;
+        while (j < arity && kin_memo_same(values[j + 1], args[j])) j++;
+        if (j == arity) {
+            memo->states[slot] |= KIN_MEMO_HIT;
+            return values;
+        }
+    }
+    return NULL;
+}
+
+// Cache the result of a call whose args were hashed by kin_memo_find
+kin_fn void kin_memo_store(KinMemo* memo, uint8_t arity, KinValue* args, uint64_t hash, KinValue result) {
+    if (!hash || !kin_is_flat(result)) return;
+    if (!memo->values) {
+        size_t values_size = (size_t)KIN_MEMO_SIZE * (arity + 1) * sizeof(KinValue);
+        char* block = (char*)calloc(1, values_size + KIN_MEMO_SIZE * (sizeof(uint64_t) + 1));
+        // A function is only slower without its cache
+        if (!block) return;
+        memo->values = (KinValue*)block;
+        memo->hashes = (uint64_t*)(block + values_size);
+        memo->states = (uint8_t*)(memo->hashes + KIN_MEMO_SIZE);
+    }
+    size_t slot = hash & (KIN_MEMO_SIZE - 1);
+    uint32_t i = 0;
+    while (i < KIN_MEMO_PROBES && memo->states[(hash + i) & (KIN_MEMO_SIZE - 1)] & KIN_MEMO_USED) i++;
+    if (i < KIN_MEMO_PROBES) {
+        slot = (hash + i) & (KIN_MEMO_SIZE - 1);
+    } else {
+        // The window is full, so give each hit slot a second chance
+        for (i = 0; i < KIN_MEMO_PROBES; i++) {
+            size_t probe = (hash + i) & (KIN_MEMO_SIZE - 1);
+            if (!(memo->states[probe] & KIN_MEMO_HIT)) {
+                slot = probe;
+                break;
+            }
+            memo->states[probe] &= ~KIN_MEMO_HIT;
+        }
+    }
+    memo->hashes[slot] = hash;
+    memo->states[slot] = KIN_MEMO_USED;
+    KinValue* values = memo->values + slot * (arity + 1);
+    values[0] = result;
+    memcpy(values + 1, args, arity * sizeof(KinValue));
+}
+#endif
+
+// A sequence is a lazy chain of values that are made one at a time as they are pulled, so
+// maps and filters over it never build the lists between them. Pulling does not change a
+// sequence. It goes through cursors instead, one for each sequence in the chain, which a
+// consumer allocates before its first pull.
+typedef enum KinSeqKind {
+    SeqRange,
+    SeqIterate,
+    SeqList,
+    SeqMap,
+    SeqFilter,
+    SeqTake,
+    SeqLines,
+} KinSeqKind;
+
+typedef struct KinSeq {
+    KinSeqKind kind;
+    // The number of cursors a pull uses, which is one more than the source's
+    uint32_t depth;
+    // The sequence a map, filter or take pulls from
+    struct KinSeq* source;
+    // The function of a map, filter or iterate, or the list of a list sequence
+    KinValue value;
+    // The first value of an iterate
+    KinValue first;
+    // The chars of a lines sequence, which has end of them
+    char* chars;
+    // The start, end and step of a range, or the count of a take. A range without an end never ends.
+    long start;
+    long end;
+    long step;
+    bool bounded;
+} KinSeq;
+
+typedef struct KinSeqCursor {
+    // The next int of a range, the next index of a list, the start of the next line, or the number of values pulled
+    long i;
+    // The last value of an iterate
+    KinValue value;
+} KinSeqCursor;
 
-#ifndef min
-#define min(a, b) a < b ? a : b
-#endif
+#define new_seq(seq) new_val(Seq, seq)
 
-void kin_push_call_stack(char* call_string) {
-    size_t new_len = kin_call_stack_len + 1;
-    if (new_len >= kin_call_stack_capacity) {
-        kin_call_stack_capacity = kin_call_stack_capacity == 0 ? 1 : kin_call_stack_capacity * 2;
-        kin_call_stack = (char**)realloc(kin_call_stack, kin_call_stack_capacity * sizeof(char*));
+#ifdef KIN_SHARD
+KinSeqCursor* kin_seq_start(KinSeq* seq);
+bool kin_seq_next(KinSeq* seq, KinSeqCursor* cursor, KinValue* out);
+KinValue kin_range(uint8_t count, KinValue* args);
+KinValue kin_iterate(uint8_t count, KinValue* args);
+KinValue kin_map_seq(uint8_t count, KinValue* args);
+KinValue kin_filter(uint8_t count, KinValue* args);
+KinValue kin_take(uint8_t count, KinValue* args);
+KinValue kin_fold(uint8_t count, KinValue* args);
+KinValue kin_each(uint8_t count, KinValue* args);
+KinValue kin_collect(uint8_t count, KinValue* args);
+#else
+kin_fn bool kin_is_true(KinValue val);
+
+static KinSeq* kin_new_seq(KinSeqKind kind, KinSeq* source, KinValue value) {
+    KinSeq* seq = (KinSeq*)kin_alloc(Seq, sizeof(KinSeq));
+    memset(seq, 0, sizeof(KinSeq));
+    seq->kind = kind;
+    seq->depth = source ? source->depth + 1 : 1;
+    seq->source = source;
+    seq->value = value;
+    return seq;
+}
+
+// Get the sequence a value is, where a list or nil is a sequence of its values
+static KinSeq* kin_as_seq(KinValue val, char* message) {
+    KinValue head = kin_unlink(val);
+    if (head.type == Seq) return head.data.Seq;
+    return kin_new_seq(SeqList, NULL, new_list(kin_as_list(head, message)));
+}
+
+// Whether a cursor of a chain holds a value that may point to nodes allocated since the pull began
+static bool kin_seq_holds_nodes(KinSeq* seq, KinSeqCursor* cursor) {
+    for (; seq; seq = seq->source, cursor++)
+        if (seq->kind == SeqIterate && !kin_is_flat(cursor->value)) return true;
+    return false;
+}
+
+// Allocate and set the cursors for pulling from a sequence
+kin_fn KinSeqCursor* kin_seq_start(KinSeq* seq) {
+    KinSeqCursor* cursors = (KinSeqCursor*)kin_alloc(Seq, seq->depth * sizeof(KinSeqCursor));
+    for (KinSeqCursor* cursor = cursors; seq; seq = seq->source, cursor++) {
+        cursor->i = seq->kind == SeqRange ? seq->start : 0;
+        cursor->value = seq->first;
     }
-    kin_call_stack[kin_call_stack_len] = call_string;
-    kin_call_stack_len = new_len;
+    return cursors;
 }
 
-void kin_pop_call_stack() {
-    kin_call_stack_len -= 1;
+// Pull the next value of a sequence into out. Returns false if the sequence has ended.
+kin_fn bool kin_seq_next(KinSeq* seq, KinSeqCursor* cursor, KinValue* out) {
+    switch (seq->kind) {
+    case SeqRange:
+        if (seq->bounded && (seq->step > 0 ? cursor->i >= seq->end : cursor->i <= seq->end)) return false;
+        *out = new_int(cursor->i);
+        cursor->i += seq->step;
+        return true;
+    case SeqIterate:
+        if (cursor->i++) cursor->value = kin_call_value(seq->value, 1, &cursor->value);
+        *out = cursor->value;
+        return true;
+    case SeqList:
+        if ((size_t)cursor->i >= seq->value.data.List->len) return false;
+        *out = kin_list_get(seq->value.data.List, (size_t)cursor->i);
+        cursor->i++;
+        return true;
+    case SeqMap:
+        if (!kin_seq_next(seq->source, cursor + 1, out)) return false;
+        *out = kin_call_value(seq->value, 1, out);
+        return true;
+    case SeqFilter:
+        for (;;) {
+            KinArenaMark mark = kin_arena_mark();
+            if (!kin_seq_next(seq->source, cursor + 1, out)) return false;
+            if (kin_is_true(kin_call_value(seq->value, 1, out))) return true;
+            // A skipped value is dropped along with its nodes
+            if (!kin_seq_holds_nodes(seq->source, cursor + 1)) kin_arena_release(mark);
+        }
+    case SeqTake:
+        if (cursor->i >= seq->end) return false;
+        cursor->i++;
+        return kin_seq_next(seq->source, cursor + 1, out);
+    case SeqLines: {
+        if (cursor->i >= seq->end) return false;
+        char* line = seq->chars + cursor->i;
+        size_t rest = (size_t)(seq->end - cursor->i);
+        char* newline = (char*)memchr(line, '\n', rest);
+        size_t len = newline ? (size_t)(newline - line) : rest;
+        cursor->i += len + 1;
+        if (len && line[len - 1] == '\r') len--;
+        if (len >= KIN_BUILT) kin_panic_impl("Attempted to read a line that is too long");
+        *out = new_string(line, len);
+        return true;
+    }
+    }
+    return false;
 }
 
-void kin_panic_impl(char* message) {
-    printf("%s\n", message);
-    for (int i = kin_call_stack_len - 1; i >= 0; i--)
-        printf("at %s\n", kin_call_stack[i]);
-    exit(EXIT_FAILURE);
+// Create a sequence of the ints from a start up to an end, by a step that defaults to 1.
+// Without an end, the sequence never ends.
+kin_fn KinValue kin_range(uint8_t count, KinValue* args) {
+    KinValue start = kin_unlink(count >= 1 ? args[0] : KIN_NIL);
+    KinValue end = kin_unlink(count >= 2 ? args[1] : KIN_NIL);
+    KinValue step = kin_unlink(count >= 3 ? args[2] : new_int(1));
+    if (start.type != Int) kin_unary_type_panic("Attempted to start a range at %s", start.type);
+    if (end.type != Int && end.type != Nil) kin_unary_type_panic("Attempted to end a range at %s", end.type);
+    if (step.type != Int) kin_unary_type_panic("Attempted to step a range by %s", step.type);
+    if (step.data.Int == 0) kin_panic_impl("Attempted to step a range by 0");
+    KinSeq* seq = kin_new_seq(SeqRange, NULL, KIN_NIL);
+    seq->start = start.data.Int;
+    seq->end = end.type == Int ? end.data.Int : 0;
+    seq->step = step.data.Int;
+    seq->bounded = end.type == Int;
+    return new_seq(seq);
 }
 
-// The type of a byte
-typedef unsigned char byte;
+// Create a sequence that starts with a value and calls a function on each value to get the next
+kin_fn KinValue kin_iterate(uint8_t count, KinValue* args) {
+    KinSeq* seq = kin_new_seq(SeqIterate, NULL, count >= 2 ? args[1] : KIN_NIL);
+    seq->first = count >= 1 ? args[0] : KIN_NIL;
+    return new_seq(seq);
+}
 
-// The Kin string representation
-typedef struct KinString {
-    char* s;
-    size_t len;
-} KinString;
+// Create a sequence of the results of calling a function on each value of a sequence
+kin_fn KinValue kin_map_seq(uint8_t count, KinValue* args) {
+    KinSeq* source = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to map %s");
+    return new_seq(kin_new_seq(SeqMap, source, count >= 2 ? args[1] : KIN_NIL));
+}
 
-// Kin types
-typedef enum KinType {
-    Nil,
-    Bool,
-    Int,
-    Real,
-    String,
-    Function,
-    Closure,
-    Error,
-} KinType;
+// Create a sequence of the values of a sequence for which a function returns true
+kin_fn KinValue kin_filter(uint8_t count, KinValue* args) {
+    KinSeq* source = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to filter %s");
+    return new_seq(kin_new_seq(SeqFilter, source, count >= 2 ? args[1] : KIN_NIL));
+}
 
-static char* kin_type_names[] = {
-    "nil",
-    "bool",
-    "int",
-    "real",
-    "string",
-    "function",
-    "function",
-    "error",
-};
+// Create a sequence of at most a number of the first values of a sequence
+kin_fn KinValue kin_take(uint8_t count, KinValue* args) {
+    KinSeq* source = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to take from %s");
+    KinValue n = kin_unlink(count >= 2 ? args[1] : KIN_NIL);
+    if (n.type != Int) kin_unary_type_panic("Attempted to take %s values", n.type);
+    KinSeq* seq = kin_new_seq(SeqTake, source, KIN_NIL);
+    seq->end = n.data.Int;
+    return new_seq(seq);
+}
 
-// Foward declarations
+// Combine the values of a sequence into an initial value with a function of it and each value.
+// Once a value is combined, the nodes allocated for it are released, unless the result may point to them.
+kin_fn KinValue kin_fold(uint8_t count, KinValue* args) {
+    KinSeq* seq = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to fold %s");
+    KinValue fold_args[2] = { count >= 2 ? args[1] : KIN_NIL, KIN_NIL };
+    KinValue f = count >= 3 ? args[2] : KIN_NIL;
+    KinSeqCursor* cursors = kin_seq_start(seq);
+    for (;;) {
+        KinArenaMark mark = kin_arena_mark();
+        if (!kin_seq_next(seq, cursors, &fold_args[1])) break;
+        fold_args[0] = kin_call_value(f, 2, fold_args);
+        if (kin_is_flat(fold_args[0]) && !kin_seq_holds_nodes(seq, cursors)) kin_arena_release(mark);
+    }
+    return fold_args[0];
+}
 
-typedef struct KinValue KinValue;
+// Call a function on each value of a sequence, releasing the nodes allocated for each value once it is done
+kin_fn KinValue kin_each(uint8_t count, KinValue* args) {
+    KinSeq* seq = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to iterate over %s");
+    KinValue f = count >= 2 ? args[1] : KIN_NIL;
+    KinSeqCursor* cursors = kin_seq_start(seq);
+    KinValue val;
+    for (;;) {
+        KinArenaMark mark = kin_arena_mark();
+        if (!kin_seq_next(seq, cursors, &val)) break;
+        kin_call_value(f, 1, &val);
+        if (!kin_seq_holds_nodes(seq, cursors)) kin_arena_release(mark);
+    }
+    return KIN_NIL;
+}
 
-// The function pointer type for regular Kin functions
-typedef KinValue(*KinFn)(uint8_t, KinValue* args);
-// The function pointer type for Kin closures
-typedef KinValue(*KinClosureFn)(uint8_t, KinValue* args, KinValue* captures);
+// Create a list of the values of a sequence
+kin_fn KinValue kin_collect(uint8_t count, KinValue* args) {
+    KinSeq* seq = kin_as_seq(count >= 1 ? args[0] : KIN_NIL, "Attempted to collect %s");
+    KinSeqCursor* cursors = kin_seq_start(seq);
+    KinList* list = &kin_empty_list;
+    KinValue val;
+    while (kin_seq_next(seq, cursors, &val)) list = kin_list_push(list, val);
+    return new_list(list);
+}
+#endif
 
-// A Kin closure
-typedef struct KinFunction {
-    KinValue* captures;
-    KinClosureFn f;
-} KinFunction;
+// Files of at least KIN_MAP_MIN bytes are mapped into memory rather than copied, where the
+// platform allows it, and the strings read from them point directly into the mapping. A
+// mapped file stays mapped until the run ends, since nothing tracks which values still point
+// into it, so a program that reads many large files holds all of them. Smaller regular files
+// are read into the node arena and released with the nodes of the call that read them. Other
+// files, such as pipes, and every file on Windows, are read into buffers that are also kept
+// until the run ends.
+#ifndef KIN_MAP_MIN
+#define KIN_MAP_MIN (1 << 20)
+#endif
+#ifdef KIN_SHARD
+KinValue kin_read_file(uint8_t count, KinValue* args);
+KinValue kin_lines(uint8_t count, KinValue* args);
+#else
+// Read the rest of a stream into a buffer, for files that cannot be mapped
+static bool kin_read_stream(FILE* stream, KinFile* file) {
+    size_t capacity = 65536;
+    char* chars = (char*)malloc(capacity);
+    size_t len = 0;
+    while (chars) {
+        len += fread(chars + len, 1, capacity - len, stream);
+        if (len < capacity && !ferror(stream)) {
+            file->chars = chars;
+            file->len = len;
+            return true;
+        }
+        char* grown = len < capacity ? NULL : (char*)realloc(chars, capacity *= 2);
+        if (!grown) free(chars);
+        chars = grown;
+    }
+    return false;
+}
 
-// The data of a Kin value
-typedef union KinData {
-    bool Bool;
-    unsigned long Nat;
-    long Int;
-    double Real;
-    KinString String;
-    KinFn Function;
-    KinFunction Closure;
-    struct KinValue* Error;
-} KinData;
+#ifndef _WIN32
+// Read a small regular file into the node arena. Returns false and sets errno if it cannot be read.
+static bool kin_read_small(int fd, size_t size, KinFile* file) {
+    char* chars = (char*)kin_alloc(String, size);
+    size_t len = 0;
+    while (len < size) {
+        ssize_t n = read(fd, chars + len, size - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    file->chars = chars;
+    file->len = len;
+    return true;
+}
+#endif
 
-// A kin value with a type and data
-struct KinValue {
-    KinType type;
-    KinData data;
-    KinValue* mom;
-    KinValue* dad;
-};
+// Map the file at a path into memory, or read it if it is small or not a regular file.
+// Returns NULL and sets errno if it cannot be read.
+static KinFile* kin_open_file(KinValue path, bool sequential) {
+    path = kin_unlink(path);
+    if (path.type != String) kin_unary_type_panic("Attempted to read a file at %s", path.type);
+    char* name = (char*)kin_alloc(String, kin_str_len(path) + 1);
+    memcpy(name, kin_str_s(path), kin_str_len(path));
+    name[kin_str_len(path)] = '\0';
+    KinFile file = { kin_files, NULL, 0, false };
+#ifdef _WIN32
+    FILE* stream = fopen(name, "rb");
+    if (!stream) return NULL;
+    bool read = kin_read_stream(stream, &file);
+    fclose(stream);
+    if (!read) return NULL;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // Pipes and files whose size is unknown, which includes empty ones, cannot be mapped
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        FILE* stream = fdopen(fd, "rb");
+        bool read = stream && kin_read_stream(stream, &file);
+        if (stream) fclose(stream);
+        else close(fd);
+        if (!read) return NULL;
+    } else if (st.st_size < KIN_MAP_MIN) {
+        bool read = kin_read_small(fd, (size_t)st.st_size, &file);
+        int read_errno = errno;
+        close(fd);
+        errno = read_errno;
+        if (!read) return NULL;
+        // The chars go when the arena is released, so the run need not keep the file
+        KinFile* opened = (KinFile*)kin_alloc(String, sizeof(KinFile));
+        *opened = file;
+        return opened;
+    } else {
+        file.len = (size_t)st.st_size;
+        file.chars = (char*)mmap(NULL, file.len, PROT_READ, MAP_PRIVATE, fd, 0);
+        file.mapped = file.chars != MAP_FAILED;
+        close(fd);
+        if (!file.mapped) return NULL;
+        if (sequential) madvise(file.chars, file.len, MADV_SEQUENTIAL);
+    }
+#endif
+    KinFile* opened = (KinFile*)malloc(sizeof(KinFile));
+    *opened = file;
+    kin_files = opened;
+    return opened;
+}
 
-#define new_val(_type, ...) (KinValue) { .type = _type, .data = {._type = __VA_ARGS__}, .mom = NULL, .dad = NULL }
-#define new_bool(b) new_val(Bool, b)
-#define new_int(i) new_val(Int, i)
-#define new_real(i) new_val(Real, i)
-#define new_function(f) new_val(Function, f)
-#define new_closure(function, caps) new_val(Closure, { .f = function, .captures = caps })
-#define new_kin_string(string, l) (KinString) { .s = string, .len = l }
-#define new_string(s, len) new_val(String, new_kin_string(s, len))
+// Make an error with the reason a file could not be read
+static KinValue kin_file_error(KinValue path, const char* reason) {
+    path = kin_unlink(path);
+    size_t size = sizeof("Unable to read : ") + kin_str_len(path) + strlen(reason);
+    char* message = (char*)kin_alloc(Error, size);
+    snprintf(message, size, "Unable to read %.*s: %s", (int)kin_str_len(path), kin_str_s(path), reason);
+    return new_val(Error, kin_node(new_string(message, size - 1)));
+}
 
-// The nil Kin value
-static KinValue KIN_NIL = { .type = Nil, .mom = NULL, .dad = NULL };
-// The true Kin value
-static KinValue KIN_TRUE = new_bool(true);
-// The false Kin value
-static KinValue KIN_FALSE = new_bool(false);
+// Read a file into a string, or an error if it cannot be read
+kin_fn KinValue kin_read_file(uint8_t count, KinValue* args) {
+    KinValue path = count >= 1 ? args[0] : KIN_NIL;
+    KinFile* file = kin_open_file(path, false);
+    if (!file) return kin_file_error(path, strerror(errno));
+    if (file->len >= KIN_BUILT) return kin_file_error(path, "it is too long for one string, but lines can read it");
+    return new_string(file->chars, file->len);
+}
 
-KinValue kin_head(KinValue val) {
-    val.mom = NULL;
-    val.dad = NULL;
-    return val;
+// Create a sequence of the lines of a file, without their line endings, or an error if it
+// cannot be read
+kin_fn KinValue kin_lines(uint8_t count, KinValue* args) {
+    KinValue path = count >= 1 ? args[0] : KIN_NIL;
+    KinFile* file = kin_open_file(path, true);
+    if (!file) return kin_file_error(path, strerror(errno));
+    KinSeq* seq = kin_new_seq(SeqLines, NULL, KIN_NIL);
+    seq->chars = file->chars;
+    seq->end = (long)file->len;
+    return new_seq(seq);
 }
 
-KinValue kin_mom(uint8_t count, KinValue* args) {
-    KinValue val = count >= 1 ? args[0] : KIN_NIL;
-    return val.mom ? *val.mom : KIN_NIL;
+// Unmap or free the files read by a run
+static void kin_close_files() {
+    while (kin_files) {
+        KinFile* prev = kin_files->prev;
+#ifndef _WIN32
+        if (kin_files->mapped) munmap(kin_files->chars, kin_files->len);
+        else
+#endif
+        free(kin_files->chars);
+        free(kin_files);
+        kin_files = prev;
+    }
 }
+#endif
 
-KinValue kin_dad(uint8_t count, KinValue* args) {
-    KinValue val = count >= 1 ? args[0] : KIN_NIL;
-    return val.dad ? *val.dad : KIN_NIL;
+#ifdef KIN_SITE_TABLE
+
+// Call a value from a call site
+#define kin_call(val, count, args, call_site) (kin_local_frame.site = (call_site), kin_call_value(val, count, args))
+// Call a binary operator from a call site
+#define kin_call_bin_op(f, a, b, call_site) (kin_local_frame.site = (call_site), f(a, b))
+// Make a direct call to a statically known function from a call site
+#define kin_call_static(call, call_site) (kin_stats_direct_call(), kin_local_frame.site = (call_site), call)
+// Make a direct call to a typed clone, which returns an unboxed value of the given C type
+#define kin_call_static_as(type, call, call_site) (kin_stats_direct_call(), kin_local_frame.site = (call_site), call)
+
+#else
+
+// Call a value from a call site
+#ifdef KIN_SHARD
+KinValue kin_call(KinValue val, int count, KinValue* args, uint32_t site);
+KinValue kin_call_bin_op(KinValue f(KinValue, KinValue), KinValue a, KinValue b, uint32_t site);
+#else
+kin_fn KinValue kin_call(KinValue val, int count, KinValue* args, uint32_t site) {
+    kin_push_call_stack(site);
+    KinValue res = kin_call_value(val, count, args);
+    kin_pop_call_stack();
+    return res;
 }
 
-void kin_binary_type_panic(char* message, KinType a, KinType b) {
-    char str[256];
-    sprintf(str, message, kin_type_names[a], kin_type_names[b]);
-    kin_panic_impl(str);
+// Call a binary operator from a call site
+kin_fn KinValue kin_call_bin_op(KinValue f(KinValue, KinValue), KinValue a, KinValue b, uint32_t site) {
+    kin_push_call_stack(site);
+    KinValue res = f(a, b);
+    kin_pop_call_stack();
+    return res;
 }
+#endif
 
-void kin_unary_type_panic(char* message, KinType ty) {
-    char str[256];
-    sprintf(str, message, kin_type_names[ty]);
-    kin_panic_impl(str);
+static inline KinValue kin_pop_call_result(KinValue res) {
+    kin_pop_call_stack();
+    return res;
 }
 
-// Create a new Kin error from a value
-KinValue kin_error(uint8_t count, KinValue* inner) {
-    return new_val(Error, inner);
+static inline long kin_pop_call_result_long(long res) {
+    kin_pop_call_stack();
+    return res;
 }
 
-// Call a Kin function or closure value
-KinValue kin_call(KinValue val, int count, KinValue* args, char* call_site) {
-    kin_push_call_stack(call_site);
-    KinValue res;
-    switch (val.type) {
-    case Function:;
-        res = (*val.data.Function)(count, args);
-        kin_pop_call_stack();
-        return res;
-    case Closure:;
-        res = (*val.data.Closure.f)(count, args, val.data.Closure.captures);
-        kin_pop_call_stack();
-        return res;
-    default:
-        kin_unary_type_panic("Attempted to call %s value", val.type);
-        return KIN_NIL;
-    }
+static inline double kin_pop_call_result_double(double res) {
+    kin_pop_call_stack();
+    return res;
 }
 
-KinValue kin_print(uint8_t count, KinValue* args) {
+static inline bool kin_pop_call_result_bool(bool res) {
+    kin_pop_call_stack();
+    return res;
+}
+
+// Make a direct call to a statically known function from a call site
+#define kin_call_static(call, call_site) kin_pop_call_result((kin_stats_direct_call(), kin_push_call_stack(call_site), call))
+// Make a direct call to a typed clone, which returns an unboxed value of the given C type
+#define kin_call_static_as(type, call, call_site) kin_pop_call_result_## type((kin_stats_direct_call(), kin_push_call_stack(call_site), call))
+
+#endif
+
+#ifdef KIN_SHARD
+KinValue kin_print(uint8_t count, KinValue* args);
+KinValue kin_println(uint8_t count, KinValue* args);
+KinValue kin_panic(uint8_t count, KinValue* args);
+KinValue kin_add(KinValue a, KinValue b);
+KinValue kin_sub(KinValue a, KinValue b);
+KinValue kin_mul(KinValue a, KinValue b);
+KinValue kin_div(KinValue a, KinValue b);
+KinValue kin_rem(KinValue a, KinValue b);
+#else
+kin_fn KinValue kin_print(uint8_t count, KinValue* args) {
     KinValue val = count >= 1 ? args[0] : KIN_NIL;
+    val = kin_unlink(val);
     switch (val.type) {
     case Nil:
-        printf("nil");
+        kin_write_lit("nil");
         break;
     case Bool:
-        if (val.data.Bool) printf("true");
-        else printf("false");
+        if (val.data.Bool) kin_write_lit("true");
+        else kin_write_lit("false");
         break;
     case Int:
-        printf("%ld", val.data.Int);
+        kin_write_int(val.data.Int);
         break;
-    case Real:;
-        char str[50];
-        sprintf(str, "%f", val.data.Real);
-        int i = strlen(str);
-        if (i == 0) break;
-        i -= 1;
-        while (str[i] == '0' || str[i] == '.') i--;
-        printf("%*.*s", i + 1, i + 1, str);
+    case Real:
+        kin_write_real(val.data.Real);
         break;
-    case String:;
-        int len = val.data.String.len;
-        printf("%*.*s", len, len, val.data.String.s);
+    case String:
+        kin_write(kin_str_s(val), kin_str_len(val));
         break;
     case Function:
     case Closure:
-        printf("function");
+        kin_write_lit("function");
         break;
     case Error:
-        printf("Error: ");
+        kin_write_lit("Error: ");
         kin_print(1, val.data.Error);
         break;
+    case List:
+        kin_write_lit("[");
+        for (size_t i = 0; i < val.data.List->len; i++) {
+            if (i) kin_write_lit(" ");
+            kin_print(1, &kin_list_get(val.data.List, i));
+        }
+        kin_write_lit("]");
+        break;
+    case Map:
+        kin_write_lit("{");
+        if (val.data.Map->root) kin_map_print(val.data.Map->root, true);
+        kin_write_lit("}");
+        break;
+    case Seq: {
+        // The values are printed as they are pulled, and their nodes are released once printed
+        KinSeqCursor* cursors = kin_seq_start(val.data.Seq);
+        KinValue item;
+        kin_write_lit("[");
+        for (bool first = true;; first = false) {
+            KinArenaMark mark = kin_arena_mark();
+            if (!kin_seq_next(val.data.Seq, cursors, &item)) break;
+            if (!first) kin_write_lit(" ");
+            kin_print(1, &item);
+            if (!kin_seq_holds_nodes(val.data.Seq, cursors)) kin_arena_release(mark);
+        }
+        kin_write_lit("]");
+        break;
+    }
     }
     return val;
 }
 
-KinValue kin_println(uint8_t count, KinValue* args) {
+kin_fn KinValue kin_println(uint8_t count, KinValue* args) {
     KinValue res = kin_print(count, args);
-    printf("\n");
+    kin_write_lit("\n");
     return res;
 }
 
-KinValue kin_panic(uint8_t count, KinValue* args) {
-    printf("\nKin panicked:\n");
+kin_fn KinValue kin_panic(uint8_t count, KinValue* args) {
+    kin_write_lit("\nKin panicked:\n");
     kin_println(count, args);
     kin_panic_impl("");
     return KIN_NIL;
 }
 
-KinValue kin_call_bin_op(KinValue f(KinValue, KinValue), KinValue a, KinValue b, char* call_site) {
-    kin_push_call_stack(call_site);
-    KinValue res = f(a, b);
-    kin_pop_call_stack();
-    return res;
-}
-
-KinValue kin_add(KinValue a, KinValue b) {
+kin_fn KinValue kin_add(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Int:
         switch (b.type) {
@@ -248,13 +2625,19 @@ KinValue kin_add(KinValue a, KinValue b) {
             return new_real(a.data.Real + b.data.Real);
         default: break;
         }
+        break;
+    case String:
+        if (b.type == String) return kin_concat(a, b);
+        break;
     default: break;
     }
     kin_binary_type_panic("Attempted to add incompatible types %s and %s", a.type, b.type);
     return KIN_NIL;
 }
 
-KinValue kin_sub(KinValue a, KinValue b) {
+kin_fn KinValue kin_sub(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Int:
         switch (b.type) {
@@ -278,7 +2661,9 @@ KinValue kin_sub(KinValue a, KinValue b) {
     return KIN_NIL;
 }
 
-KinValue kin_mul(KinValue a, KinValue b) {
+kin_fn KinValue kin_mul(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Int:
         switch (b.type) {
@@ -302,7 +2687,9 @@ KinValue kin_mul(KinValue a, KinValue b) {
     return KIN_NIL;
 }
 
-KinValue kin_div(KinValue a, KinValue b) {
+kin_fn KinValue kin_div(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Int:
         switch (b.type) {
@@ -326,7 +2713,9 @@ KinValue kin_div(KinValue a, KinValue b) {
     return KIN_NIL;
 }
 
-KinValue kin_rem(KinValue a, KinValue b) {
+kin_fn KinValue kin_rem(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Int:
         switch (b.type) {
@@ -349,14 +2738,32 @@ KinValue kin_rem(KinValue a, KinValue b) {
     kin_binary_type_panic("Attempted to divide incompatible types %s and %s", a.type, b.type);
     return KIN_NIL;
 }
+#endif
 
-#define bin_fn(f) KinValue f## _fn(uint8_t count, KinValue* args) {  \
+#ifdef KIN_SHARD
+#define bin_fn(f) KinValue f## _fn(uint8_t count, KinValue* args)
+#else
+#define bin_fn(f) kin_fn KinValue f## _fn(uint8_t count, KinValue* args) {  \
     KinValue left = count >= 1 ? args[0] : KIN_NIL; \
     KinValue right = count >= 2 ? args[1] : KIN_NIL; \
     return f(left, right); \
 }
+#endif
 
-bool kin_eq_impl(KinValue a, KinValue b) {
+#ifdef KIN_SHARD
+bool kin_eq_impl(KinValue a, KinValue b);
+bool kin_lt_impl(KinValue a, KinValue b);
+bool kin_gt_impl(KinValue a, KinValue b);
+KinValue kin_eq(KinValue a, KinValue b);
+KinValue kin_neq(KinValue a, KinValue b);
+KinValue kin_lt(KinValue a, KinValue b);
+KinValue kin_le(KinValue a, KinValue b);
+KinValue kin_gt(KinValue a, KinValue b);
+KinValue kin_ge(KinValue a, KinValue b);
+#else
+kin_fn bool kin_eq_impl(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Nil: return b.type == Nil;
     case Bool: return b.type == Bool && a.data.Bool == b.data.Bool;
@@ -377,20 +2784,31 @@ bool kin_eq_impl(KinValue a, KinValue b) {
         default: return false;
         }
     case String:
-        if (b.type == String && a.data.String.len == b.data.String.len) {
-            for (int i = 0; i < a.data.String.len; i++)
-                if (a.data.String.s[i] != b.data.String.s[i]) return false;
-            return true;
-        }
-        else return false;
+        if (b.type != String) return false;
+        if (kin_str_interned(a) && kin_str_interned(b)) return kin_str_s(a) == kin_str_s(b);
+        return kin_str_len(a) == kin_str_len(b)
+            && kin_mem_mismatch(kin_str_s(a), kin_str_s(b), kin_str_len(a)) == kin_str_len(a);
     case Function: return b.type == Function && a.data.Function == b.data.Function;
-    case Closure: return b.type == Closure && a.data.Closure.f == b.data.Closure.f;
+    case Closure: return b.type == Closure && kin_closure(a).f == kin_closure(b).f;
     case Error: return b.type == Error && kin_eq_impl(*a.data.Error, *b.data.Error);
+    case List:
+        if (b.type != List || a.data.List->len != b.data.List->len) return false;
+        if (a.data.List == b.data.List) return true;
+        for (size_t i = 0; i < a.data.List->len; i++)
+            if (!kin_eq_impl(kin_list_get(a.data.List, i), kin_list_get(b.data.List, i))) return false;
+        return true;
+    case Map:
+        if (b.type != Map || a.data.Map->len != b.data.Map->len) return false;
+        return a.data.Map == b.data.Map || !a.data.Map->root || kin_map_includes(a.data.Map->root, b.data.Map);
+    // Comparing the values of sequences would pull them, so only the same sequence is equal
+    case Seq: return b.type == Seq && a.data.Seq == b.data.Seq;
     default: return false;
     }
 }
 
-bool kin_lt_impl(KinValue a, KinValue b) {
+kin_fn bool kin_lt_impl(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Bool: if (b.type == Bool) return a.data.Bool < b.data.Bool; break;
     case Int:
@@ -407,16 +2825,11 @@ bool kin_lt_impl(KinValue a, KinValue b) {
         }
     case String:
         if (b.type == String) {
-            for (int i = 0; i < min(a.data.String.len, b.data.String.len); i++) {
-                byte ac = a.data.String.s[i];
-                byte bc = b.data.String.s[i];
-                if (ac != bc) return ac < bc;
-            }
-            return a.data.String.len < b.data.String.len;
+            return kin_mem_order(kin_str_s(a), kin_str_len(a), kin_str_s(b), kin_str_len(b)) < 0;
         }
         break;
     case Function: if (b.type == Function) return (size_t)a.data.Function < (size_t)b.data.Function; break;
-    case Closure: if (b.type == Closure) return (size_t)a.data.Closure.f < (size_t)b.data.Closure.f; break;
+    case Closure: if (b.type == Closure) return (size_t)kin_closure(a).f < (size_t)kin_closure(b).f; break;
     case Error: if (b.type == Error) return kin_eq_impl(*a.data.Error, *b.data.Error); break;
     default: break;
     }
@@ -424,7 +2837,9 @@ bool kin_lt_impl(KinValue a, KinValue b) {
     return false;
 }
 
-bool kin_gt_impl(KinValue a, KinValue b) {
+kin_fn bool kin_gt_impl(KinValue a, KinValue b) {
+    a = kin_unlink(a);
+    b = kin_unlink(b);
     switch (a.type) {
     case Bool: if (b.type == Bool) return a.data.Bool > b.data.Bool; break;
     case Int:
@@ -441,16 +2856,11 @@ bool kin_gt_impl(KinValue a, KinValue b) {
         }
     case String:
         if (b.type == String) {
-            for (int i = 0; i < min(a.data.String.len, b.data.String.len); i++) {
-                byte ac = a.data.String.s[i];
-                byte bc = b.data.String.s[i];
-                if (ac != bc) return ac > bc;
-            }
-            return a.data.String.len > b.data.String.len;
+            return kin_mem_order(kin_str_s(a), kin_str_len(a), kin_str_s(b), kin_str_len(b)) > 0;
         }
         break;
     case Function: if (b.type == Function) return (size_t)a.data.Function > (size_t)b.data.Function; break;
-    case Closure: if (b.type == Closure) return (size_t)a.data.Closure.f > (size_t)b.data.Closure.f; break;
+    case Closure: if (b.type == Closure) return (size_t)kin_closure(a).f > (size_t)kin_closure(b).f; break;
     case Error: if (b.type == Error) return kin_eq_impl(*a.data.Error, *b.data.Error); break;
     default: break;
     }
@@ -458,29 +2868,30 @@ bool kin_gt_impl(KinValue a, KinValue b) {
     return false;
 }
 
-KinValue kin_eq(KinValue a, KinValue b) {
+kin_fn KinValue kin_eq(KinValue a, KinValue b) {
     return new_bool(kin_eq_impl(a, b));
 }
 
-KinValue kin_neq(KinValue a, KinValue b) {
+kin_fn KinValue kin_neq(KinValue a, KinValue b) {
     return new_bool(!kin_eq_impl(a, b));
 }
 
-KinValue kin_lt(KinValue a, KinValue b) {
+kin_fn KinValue kin_lt(KinValue a, KinValue b) {
     return new_bool(kin_lt_impl(a, b));
 }
 
-KinValue kin_le(KinValue a, KinValue b) {
+kin_fn KinValue kin_le(KinValue a, KinValue b) {
     return new_bool(kin_lt_impl(a, b) || kin_eq_impl(a, b));
 }
 
-KinValue kin_gt(KinValue a, KinValue b) {
+kin_fn KinValue kin_gt(KinValue a, KinValue b) {
     return new_bool(kin_gt_impl(a, b));
 }
 
-KinValue kin_ge(KinValue a, KinValue b) {
+kin_fn KinValue kin_ge(KinValue a, KinValue b) {
     return new_bool(kin_gt_impl(a, b) || kin_eq_impl(a, b));
 }
+#endif
 
 bin_fn(kin_add);
 bin_fn(kin_sub);
@@ -494,7 +2905,76 @@ bin_fn(kin_le);
 bin_fn(kin_gt);
 bin_fn(kin_ge);
 
-KinValue kin_neg(KinValue val) {
+// Combine the types of two values so both can be checked at once
+#define kin_type_pair(a, b) ((a) << 8 | (b))
+
+static const KinValue kin_bools[2] = { new_bool(false), new_bool(true) };
+
+// Call an operator through its inline fast path. The operands are passed by
+// pointer so the Int and Real cases never copy whole values.
+#ifdef KIN_SITE_TABLE
+#define kin_op(f, a, b, call_site) (kin_local_frame.site = (call_site), f## _fast((KinValue[]) { a }, (KinValue[]) { b }, call_site))
+#define kin_bin_op_slow(f, a, b, site) f(a, b)
+#else
+#define kin_op(f, a, b, call_site) f## _fast((KinValue[]) { a }, (KinValue[]) { b }, call_site)
+#define kin_bin_op_slow(f, a, b, site) kin_call_bin_op(f, a, b, site)
+#endif
+#define kin_eq_op(f, a, b) f## _fast((KinValue[]) { a }, (KinValue[]) { b }, 0)
+
+// Define an inline arithmetic operator with int and real fast paths
+#define arith_fast(f, int_expr, real_expr) static inline KinValue f## _fast(const KinValue* a, const KinValue* b, uint32_t site) { \
+    kin_stats_op(f, a, b); \
+    switch (kin_type_pair(a->type, b->type)) { \
+    case kin_type_pair(Int, Int): return new_int(int_expr); \
+    case kin_type_pair(Real, Real): return new_real(real_expr); \
+    default: return kin_bin_op_slow(f, *a, *b, site); \
+    } \
+}
+
+// Define an inline comparison operator with int and real fast paths
+#define cmp_fast(f, op) static inline KinValue f## _fast(const KinValue* a, const KinValue* b, uint32_t site) { \
+    kin_stats_op(f, a, b); \
+    switch (kin_type_pair(a->type, b->type)) { \
+    case kin_type_pair(Int, Int): return kin_bools[a->data.Int op b->data.Int]; \
+    case kin_type_pair(Real, Real): return kin_bools[a->data.Real op b->data.Real]; \
+    default: return kin_bin_op_slow(f, *a, *b, site); \
+    } \
+}
+
+// Equality never fails, so it has no call site to track. Interned strings are compared by pointer.
+#define eq_fast(f, op) static inline KinValue f## _fast(const KinValue* a, const KinValue* b, uint32_t site) { \
+    kin_stats_op(f, a, b); \
+    switch (kin_type_pair(a->type, b->type)) { \
+    case kin_type_pair(Int, Int): return kin_bools[a->data.Int op b->data.Int]; \
+    case kin_type_pair(Real, Real): return kin_bools[a->data.Real op b->data.Real]; \
+    case kin_type_pair(String, String): \
+        if (kin_str_interned(*a) && kin_str_interned(*b)) return kin_bools[kin_str_s(*a) op kin_str_s(*b)]; \
+        return f(*a, *b); \
+    default: return f(*a, *b); \
+    } \
+}
+
+arith_fast(kin_add, a->data.Int + b->data.Int, a->data.Real + b->data.Real);
+arith_fast(kin_sub, a->data.Int - b->data.Int, a->data.Real - b->data.Real);
+arith_fast(kin_mul, a->data.Int * b->data.Int, a->data.Real * b->data.Real);
+arith_fast(kin_div, a->data.Int / b->data.Int, a->data.Real / b->data.Real);
+arith_fast(kin_rem, a->data.Int % b->data.Int, fmod(a->data.Real, b->data.Real));
+cmp_fast(kin_lt, <);
+cmp_fast(kin_le, <=);
+cmp_fast(kin_gt, >);
+cmp_fast(kin_ge, >=);
+eq_fast(kin_eq, ==);
+eq_fast(kin_neq, !=);
+
+#ifdef KIN_SHARD
+KinValue kin_neg(KinValue val);
+KinValue kin_not(uint8_t count, KinValue* args);
+KinValue kin_find(uint8_t count, KinValue* args);
+bool kin_is_true(KinValue val);
+KinValue kin_assert(uint8_t count, KinValue* args);
+#else
+kin_fn KinValue kin_neg(KinValue val) {
+    val = kin_unlink(val);
     switch (val.type) {
     case Int: return new_int(-val.data.Int);
     case Real: return new_real(-val.data.Real);
@@ -504,17 +2984,30 @@ KinValue kin_neg(KinValue val) {
     }
 }
 
-KinValue kin_not(uint8_t count, KinValue* args) {
-    KinValue val = count >= 1 ? args[0] : KIN_NIL;
+kin_fn KinValue kin_not(uint8_t count, KinValue* args) {
+    KinValue val = kin_unlink(count >= 1 ? args[0] : KIN_NIL);
     if (val.type == Bool) return new_bool(!val.data.Bool);
     else return new_bool(val.type == Nil);
 }
 
-bool kin_is_true(KinValue val) {
+// Find the index of a substring in a string, or nil if it does not occur
+kin_fn KinValue kin_find(uint8_t count, KinValue* args) {
+    KinValue hay = kin_unlink(count >= 1 ? args[0] : KIN_NIL);
+    KinValue needle = kin_unlink(count >= 2 ? args[1] : KIN_NIL);
+    if (hay.type != String || needle.type != String) {
+        kin_binary_type_panic("Attempted to search %s for %s", hay.type, needle.type);
+        return KIN_NIL;
+    }
+    long i = kin_mem_find(kin_str_s(hay), kin_str_len(hay), kin_str_s(needle), kin_str_len(needle));
+    return i < 0 ? KIN_NIL : new_int(i);
+}
+
+kin_fn bool kin_is_true(KinValue val) {
+    val = kin_unlink(val);
     return (val.type == Bool) * val.data.Bool + (val.type != Bool) * (val.type != Nil && val.type != Error);
 }
 
-KinValue kin_assert(uint8_t count, KinValue* args) {
+kin_fn KinValue kin_assert(uint8_t count, KinValue* args) {
     KinValue val = count >= 1 ? args[0] : KIN_NIL;
     if (!kin_is_true(val)) {
         if (count >= 2) kin_panic(count - 1, args + 1);
@@ -522,5 +3015,290 @@ KinValue kin_assert(uint8_t count, KinValue* args) {
     }
     return val;
 }
+#endif
+
+
+#ifdef KIN_PARALLEL
+
+// With KIN_PARALLEL, an operator whose operands are both expensive pure calls
+// spawns the left call as a task, which idle threads can steal while the
+// spawning thread evaluates the right one. Only calls with unboxed results are
+// spawned, so nothing points into a task's arena once it is done.
+
+// The most args a spawned call can have
+#define KIN_TASK_ARGS 4
+#define KIN_TASK_QUEUE_SIZE 256
+#define KIN_MAX_THREADS 64
+// How many more levels of tasks are spawned than it takes to give every thread one
+#define KIN_TASK_DEPTH_SLACK 4
+// How many of the innermost calls of the spawning thread a queued task keeps for traces
+#define KIN_TASK_TRACE 64
+
+typedef union KinTaskSlot {
+    long Int;
+    double Real;
+    bool Bool;
+    KinValue Value;
+} KinTaskSlot;
+
+// A call to a typed clone through its task entry point
+typedef struct KinTask {
+    KinTaskSlot (*run)(KinTaskSlot* args, uint32_t site);
+    KinTaskSlot args[KIN_TASK_ARGS];
+    KinTaskSlot result;
+    uint32_t site;
+    // 0 for a task that was run when it was spawned
+    uint32_t depth;
+    int done;
+    // Where the task was spawned, which a thread that steals it puts under its own
+    // calls so a panic's trace goes on through the spawning thread's calls
+#ifdef KIN_SITE_TABLE
+    KinFrame* frame;
+#else
+    uint32_t trace_len;
+    uint32_t trace[KIN_TASK_TRACE];
+#endif
+} KinTask;
+
+// The spawned tasks of a thread that have not started. The owner pushes and
+// pops at the bottom, and other threads steal from the top.
+typedef struct KinTaskQueue {
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+    KinTask* tasks[KIN_TASK_QUEUE_SIZE];
+} KinTaskQueue;
+
+kin_global(KinTaskQueue* kin_task_queues, NULL);
+// 0 until the pool is started by the first spawn
+kin_global(size_t kin_thread_count, 0);
+// Set by the first spawn
+kin_global(uint32_t kin_task_max_depth, 1);
+kin_global(kin_thread_local size_t kin_worker, 0);
+// The call site table for the runtimes of the workers
+kin_global(KinCallSite* kin_worker_call_sites, NULL);
+// How many queued tasks the current thread is running or waiting on
+kin_global(kin_thread_local uint32_t kin_task_depth, 0);
+// Idle workers sleep until a task is queued
+kin_global(int kin_tasks_queued, 0);
+kin_global(int kin_idle_workers, 0);
+kin_global(pthread_mutex_t kin_idle_lock, PTHREAD_MUTEX_INITIALIZER);
+kin_global(pthread_cond_t kin_idle_cond, PTHREAD_COND_INITIALIZER);
+
+#ifdef KIN_SHARD
+void kin_run_task(KinTask* task, bool stolen);
+KinTask* kin_steal_task();
+void* kin_worker_main(void* worker);
+void kin_start_pool();
+void kin_spawn_task(KinTask* task);
+void kin_join_task(KinTask* task);
+#else
+// Run a task on the current thread at the depth it was spawned at
+kin_fn void kin_run_task(KinTask* task, bool stolen) {
+    uint32_t depth = kin_task_depth;
+    kin_task_depth = task->depth;
+#ifdef KIN_SITE_TABLE
+    KinFrame* frame = kin_frame;
+    kin_frame = task->frame;
+#else
+    size_t len = kin_call_stack_len;
+    if (stolen)
+        for (uint32_t i = 0; i < task->trace_len; i++) kin_push_call_stack(task->trace[i]);
+#endif
+    task->result = task->run(task->args, task->site);
+#ifdef KIN_SITE_TABLE
+    kin_frame = frame;
+#else
+    kin_call_stack_len = len;
+#endif
+    kin_task_depth = depth;
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+// Take the oldest queued task of another thread
+kin_fn KinTask* kin_steal_task() {
+    for (size_t i = 1; i < kin_thread_count; i++) {
+        KinTaskQueue* queue = &kin_task_queues[(kin_worker + i) % kin_thread_count];
+        if (__atomic_load_n(&queue->top, __ATOMIC_RELAXED) == __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED))
+            continue;
+        KinTask* task = NULL;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->top != queue->bottom) {
+            task = queue->tasks[queue->top % KIN_TASK_QUEUE_SIZE];
+            __atomic_store_n(&queue->top, queue->top + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (task) {
+            __atomic_fetch_sub(&kin_tasks_queued, 1, __ATOMIC_SEQ_CST);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+kin_fn void* kin_worker_main(void* worker) {
+    kin_worker = (size_t)worker;
+    kin_call_sites = kin_worker_call_sites;
+    for (;;) {
+        KinTask* task = kin_steal_task();
+        if (task) {
+            kin_run_task(task, true);
+            continue;
+        }
+        pthread_mutex_lock(&kin_idle_lock);
+        __atomic_fetch_add(&kin_idle_workers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&kin_tasks_queued, __ATOMIC_SEQ_CST) <= 0)
+            pthread_cond_wait(&kin_idle_cond, &kin_idle_lock);
+        __atomic_fetch_sub(&kin_idle_workers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&kin_idle_lock);
+    }
+    return NULL;
+}
+
+// Start a worker for each thread past the first. The count is KIN_THREADS
+// if it is set, or else the number of online CPUs.
+kin_fn void kin_start_pool() {
+    const char* threads = getenv("KIN_THREADS");
+    long count = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+    kin_thread_count = count < 1 ? 1 : count > KIN_MAX_THREADS ? KIN_MAX_THREADS : count;
+    kin_task_max_depth = 0;
+    if (kin_thread_count > 1) {
+        kin_task_max_depth = KIN_TASK_DEPTH_SLACK;
+        for (size_t n = 1; n < kin_thread_count; n *= 2) kin_task_max_depth++;
+    }
+    kin_worker_call_sites = kin_call_sites;
+    kin_task_queues = (KinTaskQueue*)calloc(kin_thread_count, sizeof(KinTaskQueue));
+    for (size_t i = 0; i < kin_thread_count; i++) pthread_mutex_init(&kin_task_queues[i].lock, NULL);
+    for (size_t i = 1; i < kin_thread_count; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, kin_worker_main, (void*)i);
+        pthread_detach(thread);
+    }
+}
+
+// Queue a task for another thread to steal
+kin_fn void kin_spawn_task(KinTask* task) {
+    // Only the main thread spawns before the pool exists
+    if (!kin_thread_count) kin_start_pool();
+    KinTaskQueue* queue = &kin_task_queues[kin_worker];
+    bool queued = false;
+    // A thief may run the task as soon as it is queued
+    task->depth = kin_task_depth + 1;
+    task->done = 0;
+    if (kin_task_depth < kin_task_max_depth) {
+#ifdef KIN_SITE_TABLE
+        // The spawning function's frame goes on to other calls, and the task's entry has the spawning call site
+        task->frame = kin_frame ? kin_frame->parent : NULL;
+#else
+        task->trace_len = min(kin_call_stack_len, KIN_TASK_TRACE);
+        memcpy(task->trace, kin_call_stack + kin_call_stack_len - task->trace_len, task->trace_len * sizeof(uint32_t));
+#endif
+        __atomic_fetch_add(&kin_tasks_queued, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&queue->lock);
+        queued = queue->bottom - queue->top < KIN_TASK_QUEUE_SIZE;
+        if (queued) {
+            queue->tasks[queue->bottom % KIN_TASK_QUEUE_SIZE] = task;
+            __atomic_store_n(&queue->bottom, queue->bottom + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (!queued) __atomic_fetch_sub(&kin_tasks_queued, 1, __ATOMIC_SEQ_CST);
+    }
+    if (!queued) {
+        task->result = task->run(task->args, task->site);
+        task->depth = 0;
+        return;
+    }
+    kin_task_depth++;
+    if (__atomic_load_n(&kin_idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&kin_idle_lock);
+        pthread_cond_signal(&kin_idle_cond);
+        pthread_mutex_unlock(&kin_idle_lock);
+    }
+}
+
+// Wait for a queued task's result. A task that was not stolen is run here,
+// and otherwise other tasks are run until the thread that stole it is done.
+kin_fn void kin_join_task(KinTask* task) {
+    kin_task_depth--;
+    if (__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) return;
+    KinTaskQueue* queue = &kin_task_queues[kin_worker];
+    pthread_mutex_lock(&queue->lock);
+    // Tasks are joined in the reverse order they are spawned, so an unstolen task is at the bottom
+    bool own = queue->bottom != queue->top && queue->tasks[(queue->bottom - 1) % KIN_TASK_QUEUE_SIZE] == task;
+    if (own) __atomic_store_n(&queue->bottom, queue->bottom - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->lock);
+    if (own) {
+        __atomic_fetch_sub(&kin_tasks_queued, 1, __ATOMIC_SEQ_CST);
+        kin_run_task(task, false);
+        return;
+    }
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        KinTask* other = kin_steal_task();
+        if (other) kin_run_task(other, true);
+        else sched_yield();
+    }
+}
+#endif
+
+// Spawn a direct call to a typed clone as a task with the clone's task entry
+// point and the call's args. Past the depth cutoff, there is enough stealable
+// work already, so the call is made right away without going through the pool.
+#define kin_spawn(task, field, type, call, entry, call_site, ...) do { \
+    if (kin_task_depth >= kin_task_max_depth) { \
+        task.result.field = kin_call_static_as(type, call, call_site); \
+        task.depth = 0; \
+    } else { \
+        task = (KinTask) { .run = entry, .args = { __VA_ARGS__ }, .site = call_site }; \
+        kin_spawn_task(&task); \
+    } \
+} while (0)
+
+static inline void kin_join(KinTask* task) {
+    if (task->depth) kin_join_task(task);
+}
+
+#endif
+
+// The entry point of the program. An embedded program is run by its host, and
+// a panic returns EXIT_FAILURE from the entry point instead of exiting.
+#ifdef KIN_EMBED
+
+#ifndef KIN_ENTRY
+#define KIN_ENTRY kin_main
+#endif
+
+#define kin_main_entry int KIN_ENTRY(KinRuntime* kin_host_runtime)
+#define kin_start_run() \
+    jmp_buf kin_panic_jmp; \
+    KinRuntime* kin_outer_runtime = kin_rt; \
+    kin_rt = kin_host_runtime; \
+    kin_rt->panic = &kin_panic_jmp; \
+    if (setjmp(kin_panic_jmp)) return kin_end_embedded_run(kin_outer_runtime, EXIT_FAILURE)
+#define kin_end_run() return kin_end_embedded_run(kin_outer_runtime, 0)
+
+#ifdef KIN_SHARD
+int kin_end_embedded_run(KinRuntime* outer, int status);
+#else
+// Flush the output of a run and reset its runtime for the next one, keeping its allocations
+kin_fn int kin_end_embedded_run(KinRuntime* outer, int status) {
+    kin_flush();
+    kin_call_stack_len = 0;
+    kin_frame = NULL;
+    kin_arena_release((KinArenaMark) { NULL, 0 });
+    kin_runtime_clear_interned(kin_rt);
+    kin_close_files();
+    kin_rt->panic = NULL;
+    kin_rt = outer;
+    return status;
+}
+#endif
+
+#else
+
+#define kin_main_entry int main(int argc, char** argv)
+#define kin_start_run() (kin_stats_start(), atexit(kin_flush))
+#define kin_end_run() return 0
+
+#endif
 
 #endif
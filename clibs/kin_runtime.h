@@ -0,0 +1,103 @@
+#ifndef KIN_RUNTIME_H
+#define KIN_RUNTIME_H
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The state of a running Kin program. A program built with KIN_EMBED has no
+// main. A C host runs it through its entry point instead, which is named by
+// KIN_ENTRY and is kin_main by default:
+//
+//     KinRuntime runtime = { 0 };
+//     int status = kin_main(&runtime);
+//     kin_runtime_free(&runtime);
+//
+// The entry point returns 0, or EXIT_FAILURE if the program panics. A runtime
+// keeps its allocations for later runs, but only one run can use it at a time,
+// so each host thread that runs programs needs its own. Output goes to the
+// runtime's output file, or stdout if it is NULL. The host links with -lm.
+
+// Program output is collected in a buffer that is written out when it fills up,
+// when the program exits, and before a panic message
+#define KIN_OUT_SIZE 65536
+
+// A chunk of the node arena
+typedef struct KinArenaChunk {
+    struct KinArenaChunk* prev;
+    size_t capacity;
+    size_t used;
+} KinArenaChunk;
+
+// An entry in the string intern table
+typedef struct KinInterned {
+    uint64_t hash;
+    size_t len;
+    char* s;
+    // Whether the string was copied by kin_intern, rather than being a literal
+    bool owned;
+} KinInterned;
+
+// A file read by a run. Its chars stay in place until the run ends, so strings can point into them.
+typedef struct KinFile {
+    struct KinFile* prev;
+    char* chars;
+    size_t len;
+    // Whether the chars are mapped from the file, rather than read into a buffer
+    bool mapped;
+} KinFile;
+
+typedef struct KinRuntime {
+    FILE* output;
+    // The call site table of the program. Site 0 means "no call".
+    struct KinCallSite* call_sites;
+    // With KIN_SITE_TABLE, the innermost frame of the chain on the C stack
+    struct KinFrame* frame;
+    uint32_t* call_stack;
+    size_t call_stack_len;
+    size_t call_stack_capacity;
+    // The newest chunk of the node arena
+    KinArenaChunk* arena;
+    // The last released chunk, kept so a hot function does not malloc and free a chunk on every call
+    KinArenaChunk* arena_spare;
+    // The string intern table, which uses open addressing and is at most half full
+    KinInterned* intern_table;
+    size_t intern_capacity;
+    size_t intern_len;
+    // The newest file read by the run
+    KinFile* files;
+    // Where a panic returns to in the entry point of an embedded program
+    jmp_buf* panic;
+    size_t out_len;
+    char out[KIN_OUT_SIZE];
+} KinRuntime;
+
+// Free the strings interned by a run, which are allocated with their hash before them,
+// and empty the intern table
+static inline void kin_runtime_clear_interned(KinRuntime* runtime) {
+    for (size_t i = 0; i < runtime->intern_capacity; i++)
+        if (runtime->intern_table[i].owned) free(runtime->intern_table[i].s - sizeof(uint64_t));
+    if (runtime->intern_table) memset(runtime->intern_table, 0, runtime->intern_capacity * sizeof(KinInterned));
+    runtime->intern_len = 0;
+}
+
+// Free everything a runtime holds. It can be used again afterwards.
+static inline void kin_runtime_free(KinRuntime* runtime) {
+    kin_runtime_clear_interned(runtime);
+    free(runtime->intern_table);
+    free(runtime->call_stack);
+    while (runtime->arena) {
+        KinArenaChunk* prev = runtime->arena->prev;
+        free(runtime->arena);
+        runtime->arena = prev;
+    }
+    free(runtime->arena_spare);
+    FILE* output = runtime->output;
+    memset(runtime, 0, sizeof(KinRuntime));
+    runtime->output = output;
+}
+
+#endif
@@ -1,5 +1,7 @@
 #![allow(clippy::upper_case_acronyms)]
 
+use std::borrow::Cow;
+
 use pest::Span;
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -75,6 +77,8 @@ pub struct Def<'a> {
     pub ident: Ident<'a>,
     pub params: Params<'a>,
     pub items: Items<'a>,
+    // Whether the function was marked with `@memo`
+    pub memo: bool,
 }
 
 impl<'a> Def<'a> {
@@ -209,7 +213,7 @@ pub enum Term<'a> {
     Int(i64),
     Real(f64),
     Ident(Ident<'a>),
-    String(String),
+    String(Cow<'a, str>),
     Tree(Box<[Node<'a>; 3]>),
     Closure(Box<Closure<'a>>),
 }
@@ -0,0 +1,144 @@
+use std::{
+    fs,
+    path::PathBuf,
+    process::{exit, Command, Stdio},
+    time::{Duration, Instant},
+};
+
+use itertools::*;
+
+use crate::{
+    build, cache, check, optimize::optimize, transpile::transpile, BenchArgs, BuildStatus, EXE_EXT,
+};
+
+// The results of running one benchmark
+struct BenchResult {
+    name: String,
+    runs: usize,
+    median: Duration,
+    min: Duration,
+    // In KiB
+    peak_rss: u64,
+}
+
+// Build each Kin program in the bench directory, run it repeatedly, and report its times and memory use
+pub fn bench(args: &BenchArgs) {
+    let mut paths: Vec<PathBuf> = fs::read_dir(&args.dir)
+        .unwrap_or_else(|e| {
+            println!("Unable to read {}: {}", args.dir, e);
+            exit(1)
+        })
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| path.extension().map_or(false, |ext| ext == "kin"))
+        .filter(|path| {
+            args.filter
+                .as_ref()
+                .map_or(true, |filter| bench_name(path).contains(filter.as_str()))
+        })
+        .collect();
+    paths.sort();
+    let runs = args.runs.max(1);
+    let exe = format!("build/bench{}", EXE_EXT);
+    println!(
+        "{:<16} {:>6} {:>12} {:>12} {:>14}",
+        "bench", "runs", "median ms", "min ms", "peak rss KiB"
+    );
+    let mut results = Vec::new();
+    for path in paths {
+        let name = bench_name(&path);
+        let input = fs::read_to_string(&path).unwrap();
+        let shards = args.build.shards();
+        let parallel = args.build.parallel;
+        let items = check(&input).unwrap_or_else(|| {
+            println!("Checking {} failed", name);
+            exit(1)
+        });
+        transpile(&input, optimize(items), parallel)
+            .write(shards)
+            .unwrap();
+        // Keep the cache from reusing this transpilation for a different source
+        cache::record(
+            "build/main.c",
+            cache::hash(&[
+                input.as_bytes(),
+                cache::transpiler_version().as_bytes(),
+                shards.to_string().as_bytes(),
+                parallel.to_string().as_bytes(),
+            ]),
+        );
+        if build(&args.build, "build/bench", &["-DKIN_BENCH"]) == BuildStatus::Failed {
+            println!("Compiling {} failed", name);
+            exit(1);
+        }
+        let mut times = Vec::with_capacity(runs);
+        let mut peak_rss = 0;
+        for _ in 0..runs {
+            let start = Instant::now();
+            let output = Command::new(&exe)
+                .stdout(Stdio::null())
+                .stderr(Stdio::piped())
+                .output()
+                .unwrap();
+            times.push(start.elapsed());
+            let stderr = String::from_utf8_lossy(&output.stderr);
+            if !output.status.success() {
+                print!("{}", stderr);
+                println!("{} failed", name);
+                exit(1);
+            }
+            // The runtime reports its peak RSS when built with KIN_BENCH
+            if let Some(rss) = stderr
+                .lines()
+                .filter_map(|line| line.strip_prefix("kin-bench-rss "))
+                .last()
+            {
+                peak_rss = peak_rss.max(rss.trim().parse().unwrap_or(0));
+            }
+        }
+        times.sort();
+        let result = BenchResult {
+            name,
+            runs,
+            median: (times[(runs - 1) / 2] + times[runs / 2]) / 2,
+            min: times[0],
+            peak_rss,
+        };
+        println!(
+            "{:<16} {:>6} {:>12.3} {:>12.3} {:>14}",
+            result.name,
+            result.runs,
+            millis(result.median),
+            millis(result.min),
+            result.peak_rss
+        );
+        results.push(result);
+    }
+    if let Some(path) = &args.json {
+        fs::write(path, json(&results)).unwrap();
+    }
+}
+
+fn bench_name(path: &PathBuf) -> String {
+    path.file_stem().unwrap().to_string_lossy().into_owned()
+}
+
+fn millis(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1000.0
+}
+
+fn json(results: &[BenchResult]) -> String {
+    let entries = results
+        .iter()
+        .map(|result| {
+            format!(
+                "  {{ \"name\": {:?}, \"runs\": {}, \"median_ms\": {:.3}, \"min_ms\": {:.3}, \"peak_rss_kib\": {} }}",
+                result.name,
+                result.runs,
+                millis(result.median),
+                millis(result.min),
+                result.peak_rss
+            )
+        })
+        .join(",\n");
+    format!("[\n{}\n]\n", entries)
+}
@@ -0,0 +1,43 @@
+use std::{env, fs, path::Path};
+
+use crate::transpile::fnv1a;
+
+// Build outputs are cached by recording a hash of the inputs they were made from
+// next to them in build/. A step whose inputs hash the same is skipped.
+
+// Hash the inputs of a build step
+pub fn hash(inputs: &[&[u8]]) -> u64 {
+    let hashes: Vec<u8> = inputs
+        .iter()
+        .flat_map(|input| fnv1a(input).to_le_bytes())
+        .collect();
+    fnv1a(&hashes)
+}
+
+// Identify the running build of the transpiler, so that a new one does not reuse old output
+pub fn transpiler_version() -> String {
+    env::current_exe()
+        .and_then(fs::metadata)
+        .map(|meta| format!("{} {:?}", meta.len(), meta.modified().ok()))
+        .unwrap_or_default()
+}
+
+fn hash_path(output: &str) -> String {
+    format!(
+        "build/{}.hash",
+        output.replace(|c| c == '/' || c == '\\', "_")
+    )
+}
+
+// Whether an output exists and was made from inputs with the given hash
+pub fn is_fresh(output: &str, hash: u64) -> bool {
+    Path::new(output).exists()
+        && fs::read_to_string(hash_path(output)).map_or(false, |recorded| {
+            recorded.trim() == format!("{:016x}", hash)
+        })
+}
+
+pub fn record(output: &str, hash: u64) {
+    let _ = fs::create_dir_all("build");
+    let _ = fs::write(hash_path(output), format!("{:016x}\n", hash));
+}
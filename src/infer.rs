@@ -0,0 +1,201 @@
+use crate::ast::*;
+
+// A type that is known at compile time, so values of it can be unboxed C values
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Type {
+    Bool,
+    Int,
+    Real,
+}
+
+impl Type {
+    pub fn c_type(self) -> &'static str {
+        match self {
+            Type::Bool => "bool",
+            Type::Int => "long",
+            Type::Real => "double",
+        }
+    }
+    pub fn name(self) -> &'static str {
+        match self {
+            Type::Bool => "bool",
+            Type::Int => "int",
+            Type::Real => "real",
+        }
+    }
+    // Wrap an unboxed C expression of this type in a KinValue
+    pub fn boxed(self, raw: &str) -> String {
+        match self {
+            Type::Bool => format!("new_bool({})", raw),
+            Type::Int => format!("new_int({})", raw),
+            Type::Real => format!("new_real({})", raw),
+        }
+    }
+    // The field of KinValue's data union and of KinTaskSlot that holds this type
+    pub fn field(self) -> &'static str {
+        match self {
+            Type::Bool => "Bool",
+            Type::Int => "Int",
+            Type::Real => "Real",
+        }
+    }
+    // Get the unboxed value of an unlinked KinValue expression known to have this type
+    pub fn unboxed(self, value: &str) -> String {
+        format!("{}.data.{}", value, self.field())
+    }
+    // Whether every value of the type is truthy
+    pub fn always_true(self) -> bool {
+        self != Type::Bool
+    }
+}
+
+// Get the type of a binary operation on operands of known types. These match the
+// cases of the runtime operators that cannot fail for the given types.
+pub fn bin_op_type(op: BinOp, left: Option<Type>, right: Option<Type>) -> Option<Type> {
+    let (left, right) = (left?, right?);
+    let numeric = left != Type::Bool && right != Type::Bool;
+    match op {
+        BinOp::Add | BinOp::Sub | BinOp::Mul | BinOp::Div | BinOp::Rem if numeric => {
+            Some(left.max(right))
+        }
+        BinOp::Equals
+        | BinOp::NotEquals
+        | BinOp::Less
+        | BinOp::LessOrEqual
+        | BinOp::Greater
+        | BinOp::GreaterOrEqual
+            if numeric || left == right =>
+        {
+            Some(Type::Bool)
+        }
+        BinOp::And | BinOp::Or if left == Type::Bool && right == Type::Bool => Some(Type::Bool),
+        _ => None,
+    }
+}
+
+pub fn un_op_type(op: &UnOp, inner: Option<Type>) -> Option<Type> {
+    match (op, inner?) {
+        (UnOp::Neg, Type::Bool) => None,
+        (_, ty) => Some(ty),
+    }
+}
+
+// If a node is `cond and then or else` where the condition is a bool and the
+// branches have the same type that is always true, get the parts and that type.
+// This can become a plain if/else on an unboxed temp.
+pub fn ternary<'n, 'a>(
+    expr: &'n BinExpr<'a>,
+    scope: &dyn TypeScope<'a>,
+) -> Option<(&'n Node<'a>, &'n Node<'a>, &'n Node<'a>, Type)> {
+    let and = match (&expr.op, &expr.left.kind) {
+        (BinOp::Or, NodeKind::BinExpr(and)) if and.op == BinOp::And => and,
+        _ => return None,
+    };
+    let then_type = node_type(&and.right, scope)?;
+    if node_type(&and.left, scope)? != Type::Bool || !then_type.always_true() {
+        return None;
+    }
+    if node_type(&expr.right, scope)? != then_type {
+        return None;
+    }
+    Some((&and.left, &and.right, &expr.right, then_type))
+}
+
+// The names a type is inferred in
+pub trait TypeScope<'a> {
+    // The type of a value def, or None if it is not known or the name is not a value
+    fn ident_type(&self, name: &str) -> Option<Option<Type>>;
+    // The return type of a call, if it is known
+    fn call_type(&self, _call: &CallExpr<'a>, _arg_types: &[Option<Type>]) -> Option<Type> {
+        None
+    }
+}
+
+// The defs of a block on top of the scope around it
+pub struct BlockScope<'s, 'a> {
+    defs: Vec<(&'a str, Option<Type>)>,
+    parent: &'s dyn TypeScope<'a>,
+}
+
+impl<'s, 'a> BlockScope<'s, 'a> {
+    pub fn new(parent: &'s dyn TypeScope<'a>) -> Self {
+        BlockScope {
+            defs: Vec::new(),
+            parent,
+        }
+    }
+    // Add a def of the block, whose type is inferred from the defs before it
+    pub fn define(&mut self, def: &Def<'a>) {
+        let def_type = if def.is_function() {
+            None
+        } else {
+            items_type(&def.items, self)
+        };
+        self.defs.push((def.ident.name, def_type));
+    }
+}
+
+impl<'s, 'a> TypeScope<'a> for BlockScope<'s, 'a> {
+    fn ident_type(&self, name: &str) -> Option<Option<Type>> {
+        self.defs
+            .iter()
+            .rev()
+            .find(|(def_name, _)| *def_name == name)
+            .map(|(_, ty)| *ty)
+            .or_else(|| self.parent.ident_type(name))
+    }
+    fn call_type(&self, call: &CallExpr<'a>, arg_types: &[Option<Type>]) -> Option<Type> {
+        // A call to a function local to the block is not known to the parent scope
+        if let NodeKind::Term(Term::Ident(ident), _) = &call.caller.kind {
+            if self.defs.iter().any(|(name, _)| *name == ident.name) {
+                return None;
+            }
+        }
+        self.parent.call_type(call, arg_types)
+    }
+}
+
+// Get the type of the value of a block
+pub fn items_type<'a>(items: &[Item<'a>], scope: &dyn TypeScope<'a>) -> Option<Type> {
+    let mut block = BlockScope::new(scope);
+    let mut ty = None;
+    for item in items {
+        ty = match item {
+            Item::Def(def) => {
+                block.define(def);
+                None
+            }
+            Item::Node(node) => node_type(node, &block),
+        };
+    }
+    ty
+}
+
+// Get the type of the value of a node
+pub fn node_type<'a>(node: &Node<'a>, scope: &dyn TypeScope<'a>) -> Option<Type> {
+    match &node.kind {
+        NodeKind::Term(term, _) => match term {
+            Term::Int(_) => Some(Type::Int),
+            Term::Real(_) => Some(Type::Real),
+            Term::Ident(ident) => scope.ident_type(ident.name).flatten(),
+            Term::Expr(items) => items_type(items, scope),
+            Term::String(_) | Term::Tree(_) | Term::Closure(_) => None,
+        },
+        NodeKind::BinExpr(expr) => {
+            if let Some((_, _, _, ty)) = ternary(expr, scope) {
+                return Some(ty);
+            }
+            bin_op_type(
+                expr.op,
+                node_type(&expr.left, scope),
+                node_type(&expr.right, scope),
+            )
+        }
+        NodeKind::UnExpr(expr) => un_op_type(&expr.op, node_type(&expr.inner, scope)),
+        NodeKind::Call(call) => {
+            let arg_types: Vec<Option<Type>> =
+                call.args.iter().map(|arg| node_type(arg, scope)).collect();
+            scope.call_type(call, &arg_types)
+        }
+    }
+}
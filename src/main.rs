@@ -1,10 +1,20 @@
 #![allow(unstable_name_collisions)]
 
 mod ast;
+mod bench;
+mod cache;
+mod infer;
+mod optimize;
 mod parse;
+#[cfg(test)]
+mod tests;
 mod transpile;
 
-use std::str::FromStr;
+use std::{
+    fs,
+    str::FromStr,
+    time::{Duration, Instant},
+};
 
 use clap::Clap;
 
@@ -16,27 +26,48 @@ fn main() {
     color_backtrace::install();
 
     let app = App::parse();
+    let mut timings = Timings::new(app.timings);
+
+    if let Sub::Bench(bench_args) = &app.sub {
+        bench::bench(bench_args);
+        return;
+    }
 
-    // Parse and check
     let input = std::fs::read_to_string("test.kin").unwrap();
-    let items = match parse::parse(&input) {
-        Ok(items) => items,
-        Err(errors) => {
-            for error in errors {
-                println!("{}", error)
+    let shards = app.sub.build_args().map_or(1, BuildArgs::shards);
+    let parallel = app.sub.build_args().map_or(false, |args| args.parallel);
+    // The last transpilation is reused if it was of the same source by the same transpiler
+    let transpile_hash = cache::hash(&[
+        input.as_bytes(),
+        cache::transpiler_version().as_bytes(),
+        shards.to_string().as_bytes(),
+        parallel.to_string().as_bytes(),
+    ]);
+    if app.sub.transpiles() && cache::is_fresh("build/main.c", transpile_hash) {
+        println!("Transpilation is up to date");
+    } else {
+        // Parse and check
+        let items = match timings.time("parse", || check(&input)) {
+            Some(items) => items,
+            None => {
+                timings.print();
+                exit(1);
             }
-            exit(1);
-        }
-    };
-    println!("Check succeeded");
+        };
+        println!("Check succeeded");
 
-    // Transpile
-    if !app.sub.transpiles() {
-        return;
+        // Optimize
+        let items = timings.time("optimize", || optimize::optimize(items));
+
+        // Transpile
+        if !app.sub.transpiles() {
+            return;
+        }
+        let transpilation = timings.time("transpile", || transpile(&input, items, parallel));
+        timings.time("write", || transpilation.write(shards).unwrap());
+        cache::record("build/main.c", transpile_hash);
+        println!("Transpilation succeeded");
     }
-    let transpilation = transpile(items);
-    transpilation.write().unwrap();
-    println!("Transpilation succeeded");
 
     // Compile
     let build_args = if let Some(args) = app.sub.build_args() {
@@ -44,20 +75,98 @@ fn main() {
     } else {
         return;
     };
+    match timings.time("compile", || build(build_args, "test", &[])) {
+        BuildStatus::Built => println!("Compilation succeeded"),
+        BuildStatus::UpToDate => println!("Compilation is up to date"),
+        BuildStatus::Failed => {
+            timings.print();
+            exit(1);
+        }
+    }
 
-    let ccomp = build_args.compiler.unwrap_or_else(CCompiler::find);
+    // Run
+    if !matches!(app.sub, Sub::Run(_)) {
+        return;
+    }
+    if build_args.embed.is_some() {
+        println!("An embedded program is run by its host");
+        timings.print();
+        exit(1);
+    }
+    timings.print();
+    println!();
+    let run_status = Command::new("./test").spawn().unwrap().wait().unwrap();
+    if !run_status.success() {
+        exit(1);
+    }
+}
+
+// The durations of the stages of a build, which are printed with --timings once
+// the build is done or stops early. Exiting the process skips Drop, so it is
+// printed before every exit.
+struct Timings {
+    enabled: bool,
+    stages: Vec<(&'static str, Duration)>,
+}
 
-    let mut args: Vec<String> = vec!["build/main.c".into(), "-o".into()];
+impl Timings {
+    fn new(enabled: bool) -> Self {
+        Timings {
+            enabled,
+            stages: Vec::new(),
+        }
+    }
+    fn time<T>(&mut self, stage: &'static str, f: impl FnOnce() -> T) -> T {
+        let start = Instant::now();
+        let res = f();
+        self.stages.push((stage, start.elapsed()));
+        res
+    }
+    fn print(&mut self) {
+        if !self.enabled || self.stages.is_empty() {
+            return;
+        }
+        println!();
+        for (stage, duration) in self.stages.drain(..) {
+            println!("{:<10} {:>10.3} ms", stage, duration.as_secs_f64() * 1000.0);
+        }
+    }
+}
 
-    let name = "test";
+impl Drop for Timings {
+    fn drop(&mut self) {
+        self.print();
+    }
+}
 
-    // Push target arg
-    if build_args.assembly {
-        args.push(format!("{}.asm", name));
-        args.push("-S".into());
-    } else {
-        args.push(format!("{}{}", name, EXE_EXT));
+// Parse and check a Kin source, printing its errors if it has any
+fn check(input: &str) -> Option<ast::Items> {
+    match parse::parse(input) {
+        Ok(items) => Some(items),
+        Err(errors) => {
+            for error in errors {
+                println!("{}", error)
+            }
+            None
+        }
     }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BuildStatus {
+    Built,
+    UpToDate,
+    Failed,
+}
+
+// Compile build/main.c and any shards to an executable with the given name
+fn build(build_args: &BuildArgs, name: &str, extra_args: &[&str]) -> BuildStatus {
+    use std::process::*;
+
+    let ccomp = build_args.compiler.unwrap_or_else(CCompiler::find);
+    let shards = build_args.shards();
+
+    let mut args: Vec<String> = extra_args.iter().map(|&arg| arg.into()).collect();
 
     // Push opt arg
     args.push("-O3".into());
@@ -65,6 +174,11 @@ fn main() {
     // Push C standard arg
     args.push("-std=c99".into());
 
+    // Push target CPU arg
+    if build_args.native {
+        args.push("-march=native".into());
+    }
+
     // Push stack size arg
     if let Some(size) = build_args.stack_size {
         args.push(ccomp.stack_size_arg(size * 1024 * 1024));
@@ -75,31 +189,216 @@ fn main() {
         args.push("-pg".into());
     }
 
-    let compile_status = Command::new(ccomp.name())
-        .args(args)
-        .spawn()
-        .unwrap()
-        .wait()
-        .unwrap();
-    if compile_status.success() {
-        println!("Compilation succeeded");
+    // Push call site tracking arg
+    if build_args.site_table {
+        args.push("-DKIN_SITE_TABLE".into());
+    }
+
+    // Push Kin profiling arg
+    if build_args.kin_profile {
+        if build_args.site_table {
+            println!("--kin-profile times calls on the call stack, so it cannot be used with --site-table");
+            return BuildStatus::Failed;
+        }
+        args.push("-DKIN_PROFILE".into());
+    }
+
+    // Push runtime statistics arg
+    if build_args.stats {
+        args.push("-DKIN_STATS".into());
+    }
+
+    // Push task pool args
+    if build_args.parallel {
+        if build_args.kin_profile {
+            println!("--kin-profile keeps one call tree, so it cannot be used with --parallel");
+            return BuildStatus::Failed;
+        }
+        args.push("-DKIN_PARALLEL".into());
+        args.push("-pthread".into());
+    }
+
+    // Push embedding args
+    if let Some(entry) = &build_args.embed {
+        if build_args.parallel
+            || build_args.kin_profile
+            || build_args.stats
+            || build_args.pgo.is_some()
+        {
+            println!("--embed cannot be used with --parallel, --kin-profile, --stats, or --pgo");
+            return BuildStatus::Failed;
+        }
+        args.push("-DKIN_EMBED".into());
+        args.push(format!("-DKIN_ENTRY={}", entry));
+    }
+
+    // Push value layout arg
+    if build_args.compact {
+        args.push("-DKIN_COMPACT".into());
+    }
+
+    // Push link time optimization arg
+    if build_args.lto {
+        args.push("-flto".into());
+    }
+
+    // The output is reused if it was compiled from the same C source and runtime with the same args
+    let output = if build_args.assembly {
+        format!("{}.asm", name)
+    } else if build_args.embed.is_some() {
+        format!("{}.o", name)
     } else {
-        exit(1);
+        format!("{}{}", name, EXE_EXT)
+    };
+    let mut sources = vec!["build/main.c".to_string()];
+    if shards > 1 {
+        sources.extend((0..shards).map(|i| format!("build/shard{}.c", i)));
+        sources.push("build/shared.h".into());
+    }
+    let source_text: Vec<u8> = sources
+        .iter()
+        .flat_map(|source| fs::read(source).unwrap_or_default())
+        .collect();
+    // The runtime is kin.h and the other headers in clibs that it includes
+    let mut runtime_paths: Vec<_> = fs::read_dir("clibs")
+        .map(|entries| {
+            entries
+                .filter_map(|entry| entry.ok())
+                .map(|entry| entry.path())
+                .collect()
+        })
+        .unwrap_or_default();
+    runtime_paths.retain(|path| path.extension().map_or(false, |ext| ext == "h"));
+    runtime_paths.sort();
+    let runtime_text: Vec<u8> = runtime_paths
+        .iter()
+        .flat_map(|path| fs::read(path).unwrap_or_default())
+        .collect();
+    let build_hash = cache::hash(&[
+        &source_text,
+        &runtime_text,
+        ccomp.name().as_bytes(),
+        args.join(" ").as_bytes(),
+        output.as_bytes(),
+        &build_args
+            .pgo
+            .as_ref()
+            .map_or_else(Vec::new, |input| fs::read(input).unwrap_or_default()),
+    ]);
+    if cache::is_fresh(&output, build_hash) {
+        return BuildStatus::UpToDate;
     }
 
-    // Run
-    if !matches!(app.sub, Sub::Run(_)) {
-        return;
+    // Build an instrumented executable and run it on the training input to collect a profile
+    if let Some(input) = &build_args.pgo {
+        let profile_dir = "build/pgo";
+        let _ = fs::remove_dir_all(profile_dir);
+        fs::create_dir_all(profile_dir).unwrap();
+        let mut instrumented_args = args.clone();
+        instrumented_args.push(ccomp.profile_generate_arg(profile_dir));
+        let instrumented = format!("{}{}", name, EXE_EXT);
+        if !compile(ccomp, &instrumented_args, shards, &instrumented, "-lm") {
+            return BuildStatus::Failed;
+        }
+        let training_input = match fs::File::open(input) {
+            Ok(file) => file,
+            Err(e) => {
+                println!("Unable to open training input {}: {}", input, e);
+                return BuildStatus::Failed;
+            }
+        };
+        let training_status = Command::new(format!("./{}", name))
+            .stdin(training_input)
+            .stdout(Stdio::null())
+            .status();
+        if !training_status.map_or(false, |status| status.success()) {
+            println!("Training run failed");
+            return BuildStatus::Failed;
+        }
+        if !ccomp.merge_profile(profile_dir) {
+            println!("Merging the profile failed");
+            return BuildStatus::Failed;
+        }
+        println!("Profile collection succeeded");
+        args.push(ccomp.profile_use_arg(profile_dir));
+        // The profile is looked up by the name of the output's object file,
+        // which is different when only compiling to assembly
+        if build_args.assembly && ccomp == CCompiler::Gcc {
+            args.push("-dumpbase".into());
+            args.push(format!("{}-main", name));
+        }
     }
-    println!();
-    let run_status = Command::new("./test").spawn().unwrap().wait().unwrap();
-    if !run_status.success() {
-        exit(1);
+
+    if !compile(ccomp, &args, shards, &output, build_args.target_arg()) {
+        return BuildStatus::Failed;
+    }
+    cache::record(&output, build_hash);
+    BuildStatus::Built
+}
+
+// Compile the transpiled C to the output. The shards are compiled in parallel
+// with each other and build/main.c, using a precompiled build/shared.h, and
+// then the objects are linked.
+fn compile(
+    ccomp: CCompiler,
+    args: &[String],
+    shards: usize,
+    output: &str,
+    target_args: &str,
+) -> bool {
+    use std::process::*;
+
+    let run = |command: &mut Command| command.status().unwrap().success();
+    if shards <= 1 {
+        return run(Command::new(ccomp.name())
+            .arg("build/main.c")
+            .args(args)
+            .args(&["-o", output, target_args]));
+    }
+
+    let object = |source: &str| source.replace(".c", ".o");
+    let spawn = |source: &str, pch_args: &[String]| {
+        Command::new(ccomp.name())
+            .args(args)
+            .args(pch_args)
+            .args(&["-c", source, "-o", &object(source)])
+            .spawn()
+            .unwrap()
+    };
+    let mut children = vec![spawn("build/main.c", &[])];
+    let pch = ccomp.pch_path("build/shared.h");
+    let pch_built = run(Command::new(ccomp.name()).args(args).args(&[
+        "-x",
+        "c-header",
+        "build/shared.h",
+        "-o",
+        &pch,
+    ]));
+    let sources: Vec<String> = (0..shards).map(|i| format!("build/shard{}.c", i)).collect();
+    if pch_built {
+        let pch_args = ccomp.pch_args(&pch);
+        children.extend(sources.iter().map(|source| spawn(source, &pch_args)));
     }
+    // Wait for every child, even after a failure
+    let compiled = children
+        .into_iter()
+        .map(|mut child| child.wait().unwrap().success())
+        .fold(pch_built, |all, success| all && success);
+    compiled
+        && run(Command::new(ccomp.name())
+            .arg(object("build/main.c"))
+            .args(sources.iter().map(|source| object(source)))
+            .args(args)
+            .args(&["-o", output, target_args]))
 }
 
 #[derive(Clap)]
 struct App {
+    #[clap(
+        long = "timings",
+        about = "Print how long parsing, optimization, transpilation, and C compilation took"
+    )]
+    timings: bool,
     #[clap(subcommand)]
     sub: Sub,
 }
@@ -114,6 +413,7 @@ enum Sub {
     Build(BuildArgs),
     #[clap(alias = "r")]
     Run(BuildArgs),
+    Bench(BenchArgs),
 }
 
 impl Sub {
@@ -128,6 +428,31 @@ impl Sub {
     }
 }
 
+#[derive(Clap)]
+struct BenchArgs {
+    #[clap(
+        long = "dir",
+        default_value = "benches",
+        about = "The directory of Kin programs to benchmark"
+    )]
+    dir: String,
+    #[clap(
+        long = "filter",
+        about = "Only run the benchmarks whose names contain this"
+    )]
+    filter: Option<String>,
+    #[clap(
+        long = "runs",
+        default_value = "10",
+        about = "How many times to run each benchmark"
+    )]
+    runs: usize,
+    #[clap(long = "json", about = "Also write the results to this file as JSON")]
+    json: Option<String>,
+    #[clap(flatten)]
+    build: BuildArgs,
+}
+
 #[derive(Clap)]
 struct BuildArgs {
     #[clap(long = "stack", about = "The executable stack size in MB")]
@@ -138,6 +463,77 @@ struct BuildArgs {
     assembly: bool,
     #[clap(long = "profile")]
     profile: bool,
+    #[clap(
+        long = "kin-profile",
+        about = "Count calls and cycles per Kin function and call site, written to kin-profile.txt and kin-profile.folded at exit"
+    )]
+    kin_profile: bool,
+    #[clap(
+        long = "stats",
+        about = "Count calls, operators by operand types, and bytes allocated per type, written to stderr at exit or on SIGUSR1"
+    )]
+    stats: bool,
+    #[clap(
+        long = "site-table",
+        about = "Track call sites in per-frame slots instead of a call stack"
+    )]
+    site_table: bool,
+    #[clap(
+        long = "compact",
+        about = "Use 16 byte values with out-of-line mom and dad"
+    )]
+    compact: bool,
+    #[clap(
+        long = "native",
+        about = "Optimize for the host CPU, which enables wider vector kernels"
+    )]
+    native: bool,
+    #[clap(
+        long = "pgo",
+        about = "Optimize with a profile collected by running an instrumented build with this file as input"
+    )]
+    pgo: Option<String>,
+    #[clap(long = "lto", about = "Use link time optimization")]
+    lto: bool,
+    #[clap(
+        long = "jobs",
+        default_value = "1",
+        about = "Split the C output into this many shards and compile them in parallel"
+    )]
+    jobs: usize,
+    #[clap(
+        long = "embed",
+        about = "Build an object file for a C host to link, with an entry point of this name instead of main"
+    )]
+    embed: Option<String>,
+    #[clap(
+        long = "parallel",
+        about = "Run both recursive calls of operators like `fib (n - 1) + fib (n - 2)` in parallel on a work-stealing thread pool"
+    )]
+    parallel: bool,
+}
+
+impl BuildArgs {
+    // The number of shards to split the C output into. Assembly is written for a single
+    // unit, and an embedded program keeps its runtime in one.
+    fn shards(&self) -> usize {
+        if self.assembly || self.embed.is_some() {
+            1
+        } else {
+            self.jobs.max(1)
+        }
+    }
+    // The arg that chooses what the C compiler outputs
+    fn target_arg(&self) -> &'static str {
+        if self.assembly {
+            "-S"
+        } else if self.embed.is_some() {
+            "-c"
+        } else {
+            // Link the math library, which is separate from libc on some platforms
+            "-lm"
+        }
+    }
 }
 
 const EXE_EXT: &str = if cfg!(windows) { ".exe" } else { "" };
@@ -173,6 +569,50 @@ impl CCompiler {
             CCompiler::Clang => format!("-Wl,-stack:{}", size),
         }
     }
+    pub fn profile_generate_arg(&self, dir: &str) -> String {
+        match self {
+            CCompiler::Gcc => format!("-fprofile-generate={}", dir),
+            CCompiler::Clang => format!("-fprofile-instr-generate={}/kin-%p.profraw", dir),
+        }
+    }
+    // Turn the raw profile written by an instrumented run into the form the compiler reads
+    pub fn merge_profile(&self, dir: &str) -> bool {
+        use std::process::*;
+        match self {
+            CCompiler::Gcc => true,
+            CCompiler::Clang => {
+                let raw_profiles = fs::read_dir(dir)
+                    .unwrap()
+                    .map(|entry| entry.unwrap().path())
+                    .filter(|path| path.extension().map_or(false, |ext| ext == "profraw"));
+                Command::new("llvm-profdata")
+                    .arg("merge")
+                    .arg(format!("-output={}/kin.profdata", dir))
+                    .args(raw_profiles)
+                    .status()
+                    .map_or(false, |status| status.success())
+            }
+        }
+    }
+    // Where a precompiled header is written. Gcc finds a header's .gch next to it on its own.
+    pub fn pch_path(&self, header: &str) -> String {
+        match self {
+            CCompiler::Gcc => format!("{}.gch", header),
+            CCompiler::Clang => format!("{}.pch", header),
+        }
+    }
+    pub fn pch_args(&self, pch: &str) -> Vec<String> {
+        match self {
+            CCompiler::Gcc => Vec::new(),
+            CCompiler::Clang => vec!["-include-pch".into(), pch.into()],
+        }
+    }
+    pub fn profile_use_arg(&self, dir: &str) -> String {
+        match self {
+            CCompiler::Gcc => format!("-fprofile-use={}", dir),
+            CCompiler::Clang => format!("-fprofile-instr-use={}/kin.profdata", dir),
+        }
+    }
 }
 
 impl FromStr for CCompiler {
@@ -0,0 +1,306 @@
+use std::{borrow::Cow, cmp::Ordering, collections::HashMap};
+
+use pest::Span;
+
+use crate::ast::*;
+
+// A value that is known at compile time
+#[derive(Debug, Clone, PartialEq)]
+enum Const<'a> {
+    Nil,
+    Bool(bool),
+    Int(i64),
+    Real(f64),
+    // Borrowed from the source unless it has escapes or was folded
+    String(Cow<'a, str>),
+}
+
+impl<'a> Const<'a> {
+    // Matches kin_is_true
+    fn is_true(&self) -> bool {
+        !matches!(self, Const::Nil | Const::Bool(false))
+    }
+    fn as_real(&self) -> Option<f64> {
+        match self {
+            Const::Int(i) => Some(*i as f64),
+            Const::Real(r) => Some(*r),
+            _ => None,
+        }
+    }
+    // Matches kin_eq_impl, which never fails
+    fn kin_eq(&self, other: &Self) -> bool {
+        match (self, other) {
+            (Const::Int(a), Const::Real(b)) => *a as f64 == *b,
+            (Const::Real(a), Const::Int(b)) => *a == *b as f64,
+            (a, b) => a == b,
+        }
+    }
+    // Matches kin_lt_impl and kin_gt_impl. Types they panic on are not ordered.
+    fn kin_cmp(&self, other: &Self) -> Option<Ordering> {
+        match (self, other) {
+            (Const::Bool(a), Const::Bool(b)) => Some(a.cmp(b)),
+            (Const::Int(a), Const::Int(b)) => Some(a.cmp(b)),
+            (Const::String(a), Const::String(b)) => Some(a.as_bytes().cmp(b.as_bytes())),
+            (a, b) => a.as_real()?.partial_cmp(&b.as_real()?),
+        }
+    }
+}
+
+// Fold a binary operation on constants. Operations that would panic or overflow
+// at runtime are left for the runtime.
+fn fold_bin_op<'a>(op: BinOp, a: &Const<'a>, b: &Const<'a>) -> Option<Const<'a>> {
+    Some(match op {
+        BinOp::Equals => Const::Bool(a.kin_eq(b)),
+        BinOp::NotEquals => Const::Bool(!a.kin_eq(b)),
+        BinOp::Less => Const::Bool(a.kin_cmp(b)? == Ordering::Less),
+        BinOp::LessOrEqual => Const::Bool(a.kin_cmp(b)? != Ordering::Greater),
+        BinOp::Greater => Const::Bool(a.kin_cmp(b)? == Ordering::Greater),
+        BinOp::GreaterOrEqual => Const::Bool(a.kin_cmp(b)? != Ordering::Less),
+        BinOp::Add | BinOp::Sub | BinOp::Mul | BinOp::Div | BinOp::Rem => {
+            if let (BinOp::Add, Const::String(a), Const::String(b)) = (op, a, b) {
+                Const::String(format!("{}{}", a, b).into())
+            } else if let (Const::Int(a), Const::Int(b)) = (a, b) {
+                Const::Int(match op {
+                    BinOp::Add => a.checked_add(*b),
+                    BinOp::Sub => a.checked_sub(*b),
+                    BinOp::Mul => a.checked_mul(*b),
+                    BinOp::Div => a.checked_div(*b),
+                    _ => a.checked_rem(*b),
+                }?)
+            } else {
+                let (a, b) = (a.as_real()?, b.as_real()?);
+                Const::Real(match op {
+                    BinOp::Add => a + b,
+                    BinOp::Sub => a - b,
+                    BinOp::Mul => a * b,
+                    BinOp::Div => a / b,
+                    _ => a % b,
+                })
+            }
+        }
+        BinOp::Or | BinOp::And | BinOp::Mom | BinOp::Dad => return None,
+    })
+}
+
+// Fold constant expressions, propagate constant defs, and prune `and`/`or`
+// branches whose left side has a known truthiness
+pub fn optimize(items: Items) -> Items {
+    let mut optimizer = Optimizer {
+        scope: Vec::new(),
+        bindings: HashMap::new(),
+    };
+    optimizer.push("_", Some(Const::Nil));
+    optimizer.push("nil", Some(Const::Nil));
+    optimizer.push("true", Some(Const::Bool(true)));
+    optimizer.push("false", Some(Const::Bool(false)));
+    optimizer.block(items).0
+}
+
+struct Optimizer<'a> {
+    // The names in scope, innermost last, with their values if they are constant
+    scope: Vec<(&'a str, Option<Const<'a>>)>,
+    // The indices in scope of the defs of each name, innermost last
+    bindings: HashMap<&'a str, Vec<usize>>,
+}
+
+impl<'a> Optimizer<'a> {
+    fn lookup(&self, name: &str) -> Option<&Const<'a>> {
+        let &i = self.bindings.get(name)?.last()?;
+        self.scope[i].1.as_ref()
+    }
+    fn push(&mut self, name: &'a str, value: Option<Const<'a>>) {
+        self.bindings
+            .entry(name)
+            .or_default()
+            .push(self.scope.len());
+        self.scope.push((name, value));
+    }
+    // Take the names defined since the scope had the given length out of scope
+    fn truncate(&mut self, len: usize) {
+        for (name, _) in self.scope.drain(len..) {
+            self.bindings.get_mut(name).unwrap().pop();
+        }
+    }
+    // Get the constant value of a node that has been optimized
+    fn const_of(&self, node: &Node<'a>) -> Option<Const<'a>> {
+        match &node.kind {
+            NodeKind::Term(Term::Int(i), _) => Some(Const::Int(*i)),
+            NodeKind::Term(Term::Real(r), _) => Some(Const::Real(*r)),
+            NodeKind::Term(Term::String(s), _) => Some(Const::String(s.clone())),
+            NodeKind::Term(Term::Ident(ident), _) => self.lookup(ident.name).cloned(),
+            _ => None,
+        }
+    }
+    // Make a node for a constant, if it can be written in Kin
+    fn const_node(&self, c: Const<'a>, span: Span<'a>, lifetime: Lifetime) -> Option<Node<'a>> {
+        let term = match c {
+            Const::Int(i) if i != i64::MIN => Term::Int(i),
+            Const::Real(r) if r.is_finite() => Term::Real(r),
+            Const::String(s) => Term::String(s),
+            // Nil and bools are only written as builtin names, which may be shadowed
+            Const::Nil | Const::Bool(_) => {
+                let names: &[&str] = match c {
+                    Const::Nil => &["nil", "_"],
+                    Const::Bool(true) => &["true"],
+                    _ => &["false"],
+                };
+                let name = names.iter().find(|name| self.lookup(name) == Some(&c))?;
+                Term::Ident(Ident {
+                    name,
+                    span: span.clone(),
+                })
+            }
+            _ => return None,
+        };
+        Some(Node {
+            kind: NodeKind::Term(term, span),
+            lifetime,
+        })
+    }
+    // Optimize the items of a block, whose defs go out of scope at its end. The block's
+    // value is also returned if it is constant and the block has no other effects.
+    fn block(&mut self, items: Items<'a>) -> (Items<'a>, Option<Const<'a>>) {
+        let scope_len = self.scope.len();
+        // A block that ends in a def is nil
+        let mut value = Some(Const::Nil);
+        let mut optimized = Vec::with_capacity(items.len());
+        for item in items {
+            let item = self.item(item);
+            let item_value = match &item {
+                Item::Def(def) if def.is_function() => Some(Const::Nil),
+                Item::Def(_) => self.scope.last().unwrap().1.as_ref().map(|_| Const::Nil),
+                Item::Node(node) => self.const_of(node),
+            };
+            value = value.and(item_value);
+            optimized.push(item);
+        }
+        self.truncate(scope_len);
+        (optimized, value)
+    }
+    fn item(&mut self, item: Item<'a>) -> Item<'a> {
+        match item {
+            Item::Def(def) => Item::Def(self.def(def)),
+            Item::Node(node) => Item::Node(self.node(node)),
+        }
+    }
+    fn def(&mut self, mut def: Def<'a>) -> Def<'a> {
+        if def.is_function() {
+            // A function is in scope in its own body
+            self.push(def.ident.name, None);
+            let scope_len = self.scope.len();
+            for param in &def.params {
+                self.push(param.ident.name, None);
+            }
+            def.items = self.block(def.items).0;
+            self.truncate(scope_len);
+        } else {
+            let (items, value) = self.block(def.items);
+            def.items = items;
+            if let Some(value) = &value {
+                let span = def.items.last().unwrap().span().clone();
+                let lifetime = def.items.last().unwrap().lifetime();
+                if let Some(node) = self.const_node(value.clone(), span, lifetime) {
+                    def.items = vec![Item::Node(node)];
+                }
+            }
+            self.push(def.ident.name, value);
+        }
+        def
+    }
+    fn node(&mut self, node: Node<'a>) -> Node<'a> {
+        let lifetime = node.lifetime;
+        let span = node.kind.span().clone();
+        let kind = match node.kind {
+            NodeKind::Term(term, span) => return self.term(term, span, lifetime),
+            NodeKind::BinExpr(mut expr) => {
+                let op = expr.op;
+                let left = self.node(*expr.left);
+                let right = self.node(*expr.right);
+                let (a, b) = (self.const_of(&left), self.const_of(&right));
+                if let (BinOp::And | BinOp::Or, Some(a)) = (op, &a) {
+                    // `a and b` is `b` if `a` is true, and `a or b` is `a` if `a` is true
+                    return if a.is_true() == (op == BinOp::Or) {
+                        left
+                    } else {
+                        right
+                    };
+                }
+                if let Some(node) = a
+                    .zip(b)
+                    .and_then(|(a, b)| fold_bin_op(op, &a, &b))
+                    .and_then(|c| self.const_node(c, span.clone(), lifetime))
+                {
+                    return node;
+                }
+                expr.left = left.into();
+                expr.right = right.into();
+                NodeKind::BinExpr(expr)
+            }
+            NodeKind::UnExpr(mut expr) => {
+                let op = expr.op.clone();
+                let inner = self.node(*expr.inner);
+                let folded = self.const_of(&inner).and_then(|c| match (op, c) {
+                    (UnOp::Neg, Const::Int(i)) => i.checked_neg().map(Const::Int),
+                    (UnOp::Neg, Const::Real(r)) => Some(Const::Real(-r)),
+                    (UnOp::Neg, _) => None,
+                    // A constant has no mom or dad
+                    (UnOp::Head, c) => Some(c),
+                });
+                if let Some(node) = folded.and_then(|c| self.const_node(c, span, lifetime)) {
+                    return node;
+                }
+                expr.inner = inner.into();
+                NodeKind::UnExpr(expr)
+            }
+            NodeKind::Call(mut expr) => {
+                expr.caller = self.node(*expr.caller).into();
+                expr.args = expr.args.into_iter().map(|arg| self.node(arg)).collect();
+                NodeKind::Call(expr)
+            }
+        };
+        Node { kind, lifetime }
+    }
+    fn term(&mut self, term: Term<'a>, span: Span<'a>, lifetime: Lifetime) -> Node<'a> {
+        let term = match term {
+            Term::Ident(ident) => {
+                if let Some(node) = self
+                    .lookup(ident.name)
+                    .cloned()
+                    .and_then(|c| self.const_node(c, span.clone(), lifetime))
+                {
+                    return node;
+                }
+                Term::Ident(ident)
+            }
+            Term::Expr(items) => {
+                let (items, value) = self.block(items);
+                if let Some(node) = value.and_then(|c| self.const_node(c, span.clone(), lifetime)) {
+                    return node;
+                }
+                Term::Expr(items)
+            }
+            Term::Tree(nodes) => {
+                let [left, middle, right] = *nodes;
+                Term::Tree(Box::new([
+                    self.node(left),
+                    self.node(middle),
+                    self.node(right),
+                ]))
+            }
+            Term::Closure(mut closure) => {
+                let scope_len = self.scope.len();
+                for param in &closure.params {
+                    self.push(param.ident.name, None);
+                }
+                closure.body = self.block(closure.body).0;
+                self.truncate(scope_len);
+                Term::Closure(closure)
+            }
+            term => term,
+        };
+        Node {
+            kind: NodeKind::Term(term, span),
+            lifetime,
+        }
+    }
+}
@@ -1,6 +1,6 @@
 #![allow(clippy::upper_case_acronyms)]
 
-use std::{collections::HashMap, fmt};
+use std::{borrow::Cow, collections::HashMap, fmt};
 
 use itertools::Itertools;
 use pest::{
@@ -21,6 +21,8 @@ pub enum TranspileError<'a> {
     ReturnReferencesLocal(Span<'a>),
     ForbiddenRedefinition(Ident<'a>),
     LastItemNotExpression(Span<'a>),
+    UnknownAttribute(Span<'a>),
+    MemoizedValue(Span<'a>),
 }
 
 impl<'a> fmt::Display for TranspileError<'a> {
@@ -52,6 +54,14 @@ impl<'a> fmt::Display for TranspileError<'a> {
                 span.clone(),
                 f,
             ),
+            TranspileError::UnknownAttribute(span) => format_span(
+                format!("Unknown attribute: {:?}", &span.as_str()[1..]),
+                span.clone(),
+                f,
+            ),
+            TranspileError::MemoizedValue(span) => {
+                format_span("Only functions can be memoized", span.clone(), f)
+            }
         }
     }
 }
@@ -104,18 +114,19 @@ pub fn parse(input: &str) -> Result<Items, Vec<TranspileError>> {
     }
 }
 
+// Only the lifetime of a def is needed to check references to it, so bindings do not keep defs
 #[derive(Debug, Clone)]
-enum Binding<'a> {
-    Def(Def<'a>, Lifetime),
+enum Binding {
+    Def(Lifetime),
     Param(u8),
     Builtin,
     Unfinished(u8),
 }
 
-impl<'a> Binding<'a> {
+impl Binding {
     pub fn lifetime(&self) -> Lifetime {
         match self {
-            Binding::Def(_, lt) => *lt,
+            Binding::Def(lt) => *lt,
             Binding::Param(depth) | Binding::Unfinished(depth) => Lifetime::new(*depth, *depth),
             Binding::Builtin => Lifetime::STATIC,
         }
@@ -124,7 +135,7 @@ impl<'a> Binding<'a> {
 
 #[derive(Default)]
 struct ParenScope<'a> {
-    bindings: HashMap<&'a str, Binding<'a>>,
+    bindings: HashMap<&'a str, Binding>,
 }
 
 struct FunctionScope<'a> {
@@ -177,13 +188,12 @@ impl<'a> ParseState<'a> {
         //     .sum()
         self.scopes.len() as u8
     }
-    fn bind_def(&mut self, def: Def<'a>, min_refs: u8) {
+    fn bind_def(&mut self, def: &Def<'a>, min_refs: u8) {
         let depth = self.depth();
         let refs = def.items.last().unwrap().lifetime().refs.max(min_refs);
-        self.scope().bindings.insert(
-            def.ident.name,
-            Binding::Def(def, Lifetime::new(depth, refs)),
-        );
+        self.scope()
+            .bindings
+            .insert(def.ident.name, Binding::Def(Lifetime::new(depth, refs)));
     }
     fn bind_param(&mut self, name: &'a str) {
         let depth = self.depth() - 1;
@@ -255,7 +265,18 @@ impl<'a> ParseState<'a> {
     }
     fn def(&mut self, pair: Pair<'a, Rule>) -> Item<'a> {
         let mut pairs = pair.into_inner();
-        let ident = self.bound_ident(pairs.next().unwrap());
+        let mut memo = false;
+        let mut pair = pairs.next().unwrap();
+        while let Rule::attr = pair.as_rule() {
+            match &pair.as_str()[1..] {
+                "memo" => memo = true,
+                _ => self
+                    .errors
+                    .push(TranspileError::UnknownAttribute(pair.as_span())),
+            }
+            pair = pairs.next().unwrap();
+        }
+        let ident = self.bound_ident(pair);
         let mut params = Vec::new();
         for pair in pairs.by_ref() {
             if let Rule::param = pair.as_rule() {
@@ -265,6 +286,10 @@ impl<'a> ParseState<'a> {
             }
         }
         let is_function = !params.is_empty();
+        if memo && !is_function {
+            self.errors
+                .push(TranspileError::MemoizedValue(ident.span.clone()));
+        }
         if is_function {
             if ident.is_underscore() {
                 self.errors
@@ -293,8 +318,9 @@ impl<'a> ParseState<'a> {
             ident,
             params,
             items,
+            memo,
         };
-        self.bind_def(def.clone(), min_refs);
+        self.bind_def(&def, min_refs);
         Item::Def(def)
     }
     fn expr(&mut self, pair: Pair<'a, Rule>) -> Node<'a> {
@@ -666,8 +692,13 @@ impl<'a> ParseState<'a> {
             rule => unreachable!("{:?}", rule),
         }
     }
-    fn string_literal(&mut self, pair: Pair<'a, Rule>) -> String {
-        let mut s = String::new();
+    // A literal without escapes borrows its chars from the source
+    fn string_literal(&mut self, pair: Pair<'a, Rule>) -> Cow<'a, str> {
+        let quoted = pair.as_str();
+        if !quoted.contains('\\') {
+            return Cow::Borrowed(&quoted[1..quoted.len() - 1]);
+        }
+        let mut s = String::with_capacity(quoted.len());
         for pair in pair.into_inner() {
             match pair.as_rule() {
                 Rule::raw_string => s.push_str(pair.as_str()),
@@ -704,6 +735,6 @@ impl<'a> ParseState<'a> {
                 rule => unreachable!("{:?}", rule),
             }
         }
-        s
+        Cow::Owned(s)
     }
 }
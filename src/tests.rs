@@ -0,0 +1,176 @@
+use std::{
+    fs, iter,
+    path::PathBuf,
+    process::{Command, Stdio},
+    sync::Mutex,
+    thread,
+    time::Duration,
+};
+
+use clap::Clap;
+
+use crate::{
+    build, cache, check, optimize::optimize, transpile::transpile, BuildArgs, BuildStatus, EXE_EXT,
+};
+
+// Every test builds in build/, so only one can build and run at a time
+static BUILD_LOCK: Mutex<()> = Mutex::new(());
+
+// Transpile and compile a Kin program to build/test-program, and get the path of the executable
+fn build_program(input: &str, build_args: &BuildArgs) -> Result<String, String> {
+    let shards = build_args.shards();
+    let parallel = build_args.parallel;
+    let items = check(input).ok_or("checking failed")?;
+    transpile(input, optimize(items), parallel)
+        .write(shards)
+        .unwrap();
+    // Keep the cache from reusing this transpilation for a different source
+    cache::record(
+        "build/main.c",
+        cache::hash(&[
+            input.as_bytes(),
+            cache::transpiler_version().as_bytes(),
+            shards.to_string().as_bytes(),
+            parallel.to_string().as_bytes(),
+        ]),
+    );
+    if build(build_args, "build/test-program", &[]) == BuildStatus::Failed {
+        return Err("compilation failed".into());
+    }
+    Ok(format!("build/test-program{}", EXE_EXT))
+}
+
+// Build and run each Kin program in the tests directory, and check that it prints what
+// the .out file next to it holds. A program's `-- flags:` comments give the args it is
+// built with, and a `-- fails` comment means it is expected to exit with an error. The
+// trace of a panic depends on where it happened, so only the start of its output is checked.
+#[test]
+fn programs() {
+    let _lock = BUILD_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    let mut paths: Vec<PathBuf> = fs::read_dir("tests")
+        .unwrap()
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| path.extension().map_or(false, |ext| ext == "kin"))
+        .collect();
+    paths.sort();
+    let mut failures = Vec::new();
+    for path in paths {
+        let name = path.file_stem().unwrap().to_string_lossy().into_owned();
+        let input = fs::read_to_string(&path).unwrap();
+        let flags = input
+            .lines()
+            .filter_map(|line| line.strip_prefix("-- flags:"))
+            .flat_map(str::split_whitespace);
+        let fails = input.lines().any(|line| line.trim() == "-- fails");
+        let build_args = BuildArgs::parse_from(iter::once("kin").chain(flags));
+        let exe = match build_program(&input, &build_args) {
+            Ok(exe) => exe,
+            Err(e) => {
+                failures.push(format!("{}: {}", name, e));
+                continue;
+            }
+        };
+        let output = Command::new(&exe).output().unwrap();
+        let stdout = String::from_utf8_lossy(&output.stdout);
+        let expected = fs::read_to_string(path.with_extension("out")).unwrap_or_default();
+        let matches = if fails {
+            stdout.starts_with(&expected)
+        } else {
+            stdout == expected
+        };
+        if output.status.success() == fails {
+            failures.push(format!(
+                "{}: expected {}, but it exited with {}\n{}",
+                name,
+                if fails { "an error" } else { "success" },
+                output.status,
+                String::from_utf8_lossy(&output.stderr)
+            ));
+        } else if !matches {
+            failures.push(format!(
+                "{}: expected output\n{}\nbut got\n{}",
+                name, expected, stdout
+            ));
+        }
+    }
+    assert!(failures.is_empty(), "\n{}", failures.join("\n\n"));
+}
+
+// Shards only see the runtime's functions through the prototypes in the `#ifdef KIN_SHARD`
+// blocks of kin.h, so every function defined with kin_fn must be left out of shards and
+// have a prototype there with the same signature
+#[test]
+fn shard_prototypes() {
+    let header = fs::read_to_string("clibs/kin.h").unwrap();
+    // For each open #if, whether it is a KIN_SHARD block and whether it is past its #else
+    let mut blocks: Vec<(bool, bool)> = Vec::new();
+    let mut prototypes = Vec::new();
+    let mut definitions = Vec::new();
+    for (i, line) in header.lines().enumerate() {
+        let line = line.trim();
+        if line.starts_with("#if") {
+            blocks.push((line == "#ifdef KIN_SHARD", false));
+        } else if line.starts_with("#el") {
+            blocks.last_mut().unwrap().1 = true;
+        } else if line.starts_with("#endif") {
+            blocks.pop();
+        } else if blocks.iter().any(|&(shard, other)| shard && !other) {
+            prototypes.push(line);
+        } else if let Some(signature) = line
+            .strip_prefix("kin_fn ")
+            .and_then(|line| line.strip_suffix(" {"))
+        {
+            let excluded = blocks.iter().any(|&(shard, other)| shard && other);
+            definitions.push((i + 1, signature, excluded));
+        }
+    }
+    let mut failures = Vec::new();
+    for (line, signature, excluded) in definitions {
+        if !excluded {
+            failures.push(format!(
+                "line {}: {} is also defined in shards",
+                line, signature
+            ));
+        }
+        if !prototypes
+            .iter()
+            .any(|prototype| prototype.strip_suffix(';') == Some(signature))
+        {
+            failures.push(format!(
+                "line {}: {} has no shard prototype",
+                line, signature
+            ));
+        }
+    }
+    assert!(failures.is_empty(), "\n{}", failures.join("\n"));
+}
+
+// A program built with --stats writes its stats when it gets SIGUSR1, even if it is in
+// a loop that only makes direct calls and does arithmetic
+#[cfg(unix)]
+#[test]
+fn stats_on_signal() {
+    let _lock = BUILD_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    let input =
+        "step n = n - 1\nloop n = n < 1 and n or loop (step n)\nprintln (loop 1000000000000)\n";
+    let exe = build_program(input, &BuildArgs::parse_from(&["kin", "--stats"])).unwrap();
+    let mut child = Command::new(&exe)
+        .stdout(Stdio::null())
+        .stderr(Stdio::piped())
+        .spawn()
+        .unwrap();
+    thread::sleep(Duration::from_millis(500));
+    Command::new("kill")
+        .args(&["-USR1", &child.id().to_string()])
+        .status()
+        .unwrap();
+    thread::sleep(Duration::from_millis(500));
+    child.kill().unwrap();
+    let output = child.wait_with_output().unwrap();
+    let stderr = String::from_utf8_lossy(&output.stderr);
+    assert!(
+        stderr.contains("Kin stats:"),
+        "no stats were written:\n{}",
+        stderr
+    );
+}
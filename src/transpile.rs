@@ -1,18 +1,22 @@
 use std::{
-    collections::{BTreeMap, VecDeque},
+    cell::{Cell, RefCell},
+    collections::{BTreeMap, BTreeSet, HashMap, HashSet, VecDeque},
     fs::{self, File},
     io::{self, Write},
     iter::once,
 };
 
 use itertools::*;
+use pest::Span;
 use rpds::{RedBlackTreeMap, Vector};
 
-use crate::ast::*;
+use crate::{ast::*, infer::*};
 
 struct KinDef {
     is_function: bool,
     c_name: String,
+    // The type of a value def that is held unboxed
+    ty: Option<Type>,
 }
 
 macro_rules! builtin_functions {
@@ -30,6 +34,27 @@ pub const BUILTIN_FUNCTIONS: &[(&str, &str)] = builtin_functions!(
     "panic",
     "not",
     "assert",
+    "intern",
+    "find",
+    "list",
+    "push",
+    "pop",
+    "get",
+    "set",
+    "last",
+    "len",
+    "insert",
+    "remove",
+    "range",
+    "iterate",
+    "filter",
+    "take",
+    "fold",
+    "each",
+    "collect",
+    "read_file",
+    "lines",
+    ("map", "kin_map_seq"),
     ("add", "kin_add_fn"),
     ("sub", "kin_sub_fn"),
     ("mul", "kin_mul_fn"),
@@ -91,6 +116,42 @@ static RESERVED_NAMES: &[&str] = &[
     "argv",
 ];
 
+// The builtins with effects or that call the functions they are given, which calls that
+// may run on other threads must not make
+static IMPURE_BUILTINS: &[&str] = &[
+    "kin_print",
+    "kin_println",
+    "kin_panic",
+    "kin_assert",
+    "kin_intern",
+    "kin_fold",
+    "kin_each",
+    "kin_collect",
+    "kin_read_file",
+    "kin_lines",
+];
+
+// The most args a call spawned as a task can have. Matches KIN_TASK_ARGS.
+const TASK_ARGS: usize = 4;
+
+// Stands in for the captures argument of a recursive call until the function's captures are known
+const SELF_CAPTURES: &str = "/* self captures */";
+
+// Hash a string the same way as kin_hash, so literals can be interned without hashing them at runtime
+pub fn fnv1a(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf29ce484222325, |hash, &b| {
+        (hash ^ b as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+// A call that is made without going through a function value
+struct DirectCall {
+    c_name: String,
+    // The param count of a generated function, which is called through its fixed arity entry
+    arity: Option<usize>,
+    self_call: bool,
+}
+
 #[derive(Clone)]
 struct TranspileStack<'a> {
     kin_scopes: Vector<RedBlackTreeMap<&'a str, KinDef>>,
@@ -108,6 +169,7 @@ impl<'a> TranspileStack<'a> {
                             KinDef {
                                 c_name: c_name.into(),
                                 is_function: true,
+                                ty: None,
                             },
                         )
                     })
@@ -117,6 +179,7 @@ impl<'a> TranspileStack<'a> {
                             KinDef {
                                 c_name: c_name.into(),
                                 is_function: false,
+                                ty: None,
                             },
                         )
                     }))
@@ -124,6 +187,12 @@ impl<'a> TranspileStack<'a> {
             ),
         }
     }
+    fn kin_def(&self, name: &str) -> Option<&KinDef> {
+        self.kin_scopes
+            .iter()
+            .rev()
+            .find_map(|scope| scope.get(name))
+    }
     pub fn with_kin_def(self, name: &'a str, def: KinDef) -> Self {
         TranspileStack {
             kin_scopes: self
@@ -137,19 +206,112 @@ impl<'a> TranspileStack<'a> {
     }
 }
 
+// The scope types are inferred in during transpilation, where calls to clonable functions have known types
+struct Types<'t, 'a> {
+    transpilation: &'t Transpilation<'a>,
+    stack: &'t TranspileStack<'a>,
+}
+
+impl<'t, 'a> TypeScope<'a> for Types<'t, 'a> {
+    fn ident_type(&self, name: &str) -> Option<Option<Type>> {
+        let def = self.stack.kin_def(name)?;
+        Some(if def.is_function { None } else { def.ty })
+    }
+    fn call_type(&self, call: &CallExpr<'a>, arg_types: &[Option<Type>]) -> Option<Type> {
+        let ident = match &call.caller.kind {
+            NodeKind::Term(Term::Ident(ident), _) => ident,
+            _ => return None,
+        };
+        let def = self
+            .stack
+            .kin_def(ident.name)
+            .filter(|def| def.is_function)?;
+        let source = self.transpilation.sources.get(&def.c_name)?;
+        let mut sig = arg_types.to_vec();
+        sig.resize(source.params.len(), None);
+        if sig.iter().all(Option::is_none) {
+            return None;
+        }
+        self.transpilation.return_type(&def.c_name, &sig)
+    }
+}
+
+// A function without captures, kept so that it can be cloned for calls with unboxed args
+#[derive(Clone)]
+struct FunctionSource<'a> {
+    kin_name: &'a str,
+    params: Params<'a>,
+    items: Items<'a>,
+    // The stack the function was defined in, including the function itself
+    stack: TranspileStack<'a>,
+    memo: bool,
+}
+
+// A function and the types of its params
+type Signature = (String, Vec<Option<Type>>);
+
 #[derive(Clone)]
 pub struct Transpilation<'a> {
+    input: &'a str,
+    // The byte offset at which each line of the input starts
+    line_starts: Vec<usize>,
     functions: BTreeMap<String, CFunction<'a>>,
     function_stack: Vec<String>,
+    call_sites: Vec<CCallSite<'a>>,
+    string_literals: Vec<String>,
+    // The index of each string literal in string_literals, plus one
+    string_literal_indices: HashMap<String, usize>,
+    // The C names of every variable declared in any function, which are all distinct
+    var_names: HashSet<String>,
+    // The C function that declares each variable that a Kin name can refer to
+    var_owners: HashMap<String, String>,
+    // The last suffix given to each name for variables and for functions
+    name_suffixes: HashMap<(String, bool), usize>,
+    sources: BTreeMap<String, FunctionSource<'a>>,
+    // The C names of the clones made for each signature
+    clones: BTreeMap<Signature, String>,
+    // The inferred return types of clones
+    return_types: RefCell<BTreeMap<Signature, Option<Type>>>,
+    // The return types assumed for the clones whose return types are being inferred
+    assumed_returns: RefCell<Vec<(Signature, Option<Type>)>>,
+    // The outermost index into assumed_returns read since it was last reset
+    min_assumption: Cell<usize>,
+    // Whether calls may be spawned as tasks for the KIN_PARALLEL runtime
+    parallel: bool,
+    // The clones that are spawned as tasks, which get entry points that unpack a task's args
+    tasks: BTreeSet<String>,
+    // Whether each function without captures is known to be pure
+    purity: RefCell<HashMap<String, bool>>,
+}
+
+#[derive(Clone)]
+struct CCallSite<'a> {
+    kin_name: &'a str,
+    line: usize,
+    col: usize,
 }
 
 #[derive(Clone)]
 struct CFunction<'a> {
     kin_name: &'a str,
-    exprs: VecDeque<String>,
+    // Expressions with their types if they are unboxed
+    exprs: VecDeque<(String, Option<Type>)>,
     lines: Vec<CLine>,
     captures: Vec<CCapture>,
+    // The index of each capture by its C name
+    capture_indices: HashMap<String, usize>,
     indent: usize,
+    release_arena: bool,
+    closures_escape: bool,
+    params: Vec<String>,
+    // The types of the params of a clone
+    param_types: Vec<Option<Type>>,
+    ret_type: Option<Type>,
+    // Clones are only called directly, so they have no args array entry point
+    is_clone: bool,
+    tail_calls: bool,
+    // Whether calls look for their result in the function's cache, kin_memo_{name}
+    memo: bool,
 }
 
 impl<'a> CFunction<'a> {
@@ -159,7 +321,16 @@ impl<'a> CFunction<'a> {
             exprs: Default::default(),
             lines: Default::default(),
             captures: Default::default(),
+            capture_indices: Default::default(),
             indent: 0,
+            release_arena: false,
+            closures_escape: false,
+            params: Vec::new(),
+            param_types: Vec::new(),
+            ret_type: None,
+            is_clone: false,
+            tail_calls: false,
+            memo: false,
         }
     }
 }
@@ -195,12 +366,50 @@ impl CLine {
 
 #[derive(Clone)]
 struct CCapture {
-    pub c_name: String,
     pub capture_name: String,
 }
 
 impl<'a> CFunction<'a> {
+    // The signature of the fixed arity entry point that holds the function body
+    fn direct_signature(&self, name: &str) -> String {
+        let params = self
+            .params
+            .iter()
+            .zip(&self.param_types)
+            .map(|(param, ty)| format!("{} {}", ty.map_or("KinValue", Type::c_type), param))
+            .chain((!self.captures.is_empty()).then(|| "KinValue* captures".into()))
+            .intersperse(", ".into())
+            .collect::<String>();
+        format!(
+            "{} {}_direct({})",
+            self.ret_type.map_or("KinValue", Type::c_type),
+            name,
+            if params.is_empty() { "void" } else { &params }
+        )
+    }
+    // The signature of the entry point used by spawned tasks
+    fn task_signature(&self, name: &str) -> String {
+        format!(
+            "KinTaskSlot {}_task(KinTaskSlot* args, uint32_t site)",
+            name
+        )
+    }
+    // The signature of the entry point used by function values
+    fn array_signature(&self, name: &str) -> String {
+        if self.captures.is_empty() {
+            format!("KinValue {}(uint8_t count, KinValue* args)", name)
+        } else {
+            format!(
+                "KinValue {}(uint8_t count, KinValue* args, KinValue* captures)",
+                name
+            )
+        }
+    }
     pub fn push_line(&mut self, value: impl Into<String>) -> &mut CLine {
+        let index = self.lines.len();
+        self.insert_line(index, value)
+    }
+    pub fn insert_line(&mut self, index: usize, value: impl Into<String>) -> &mut CLine {
         let line = CLine {
             var_name: None,
             type_name: None,
@@ -208,29 +417,33 @@ impl<'a> CFunction<'a> {
             indent: self.indent,
             semicolon: true,
         };
-        self.lines.push(line);
-        self.lines.last_mut().unwrap()
+        self.lines.insert(index, line);
+        &mut self.lines[index]
     }
     pub fn push_expr(&mut self, expr: String) {
-        self.exprs.push_back(expr)
+        self.exprs.push_back((expr, None))
+    }
+    pub fn push_typed_expr(&mut self, expr: String, ty: Option<Type>) {
+        self.exprs.push_back((expr, ty))
     }
+    // Pop an expression, boxing it if it is unboxed
     pub fn pop_expr(&mut self) -> Option<String> {
+        self.exprs
+            .pop_front()
+            .map(|(expr, ty)| ty.map_or_else(|| expr.clone(), |ty| ty.boxed(&expr)))
+    }
+    pub fn pop_typed_expr(&mut self) -> Option<(String, Option<Type>)> {
         self.exprs.pop_front()
     }
     pub fn capture_index_of(&self, c_name: &str) -> usize {
-        self.captures
-            .iter()
-            .position(|cap| cap.c_name == c_name)
-            .unwrap()
+        self.capture_indices[c_name]
     }
     pub fn push_capture(&mut self, c_name: String, capture_name: String) {
-        if self.captures.iter().any(|cap| cap.c_name == c_name) {
+        if self.capture_indices.contains_key(&c_name) {
             return;
         }
-        self.captures.push(CCapture {
-            c_name,
-            capture_name,
-        });
+        self.capture_indices.insert(c_name, self.captures.len());
+        self.captures.push(CCapture { capture_name });
     }
     pub fn indent(&mut self) {
         self.indent += 1;
@@ -240,133 +453,564 @@ impl<'a> CFunction<'a> {
     }
 }
 
-pub fn transpile(items: Items) -> Transpilation {
-    let mut transpilation = Transpilation::new();
-    transpilation.items(items, TranspileStack::new());
+pub fn transpile<'a>(input: &'a str, items: Items<'a>, parallel: bool) -> Transpilation<'a> {
+    let mut transpilation = Transpilation::new(input, parallel);
+    transpilation.items(items, TranspileStack::new(), false);
     transpilation
 }
 
+// Whether evaluating the items of a block may allocate arena nodes
+fn items_allocate<'a>(items: &[Item<'a>], scope: &dyn TypeScope<'a>) -> bool {
+    let mut block = BlockScope::new(scope);
+    for item in items {
+        let allocates = match item {
+            Item::Def(def) => !def.is_function() && items_allocate(&def.items, &block),
+            Item::Node(node) => node_allocates(node, &block),
+        };
+        if allocates {
+            return true;
+        }
+        if let Item::Def(def) = item {
+            block.define(def);
+        }
+    }
+    false
+}
+
+fn node_allocates<'a>(node: &Node<'a>, scope: &dyn TypeScope<'a>) -> bool {
+    match &node.kind {
+        NodeKind::Term(Term::Expr(items), _) => items_allocate(items, scope),
+        NodeKind::Term(term, _) => matches!(term, Term::Tree(_)),
+        NodeKind::BinExpr(expr) => {
+            matches!(expr.op, BinOp::Mom | BinOp::Dad)
+                || expr.op == BinOp::Add && !adds_numbers(expr, scope)
+                || node_allocates(&expr.left, scope)
+                || node_allocates(&expr.right, scope)
+        }
+        NodeKind::UnExpr(expr) => node_allocates(&expr.inner, scope),
+        NodeKind::Call(_) => true,
+    }
+}
+
+// Whether an addition is known to be of numbers. Adding anything else may allocate
+// the chars of a concatenated string.
+fn adds_numbers<'a>(expr: &BinExpr<'a>, scope: &dyn TypeScope<'a>) -> bool {
+    let left = node_type(&expr.left, scope);
+    let right = node_type(&expr.right, scope);
+    bin_op_type(BinOp::Add, left, right).is_some()
+}
+
+// Collect the names of the values and functions defined in a function body
+fn local_values<'a>(items: &[Item<'a>], locals: &mut Vec<&'a str>) {
+    for item in items {
+        if let Item::Def(def) = item {
+            locals.push(def.ident.name);
+            if !def.is_function() {
+                local_values(&def.items, locals);
+            }
+        }
+    }
+}
+
+// Whether the last item of a function body may be a tail call to the function with the given name
+fn has_tail_call(items: &[Item], name: &str) -> bool {
+    match items.last() {
+        Some(Item::Node(node)) => node_has_tail_call(node, name),
+        _ => false,
+    }
+}
+
+fn node_has_tail_call(node: &Node, name: &str) -> bool {
+    match &node.kind {
+        NodeKind::Term(Term::Expr(items), _) => has_tail_call(items, name),
+        NodeKind::BinExpr(expr) if matches!(expr.op, BinOp::Or | BinOp::And) => {
+            node_has_tail_call(&expr.right, name)
+        }
+        NodeKind::Call(call) => {
+            matches!(&call.caller.kind, NodeKind::Term(Term::Ident(ident), _) if ident.name == name)
+        }
+        _ => false,
+    }
+}
+
+// Write a real, which may have been folded, as a C double literal. Debug formatting keeps
+// the sign of -0.0 and always writes a `.` or an exponent, so C does not read an int.
+fn real_literal(r: f64) -> String {
+    if r.is_nan() {
+        "NAN".into()
+    } else if r.is_infinite() {
+        if r > 0.0 { "HUGE_VAL" } else { "-HUGE_VAL" }.into()
+    } else {
+        format!("{:?}", r)
+    }
+}
+
+// Convert a typed expression to the type inferred for it
+fn expr_as((expr, actual): (String, Option<Type>), ty: Option<Type>) -> String {
+    match (actual, ty) {
+        (None, None) => expr,
+        (Some(actual), None) => actual.boxed(&expr),
+        (Some(actual), Some(ty)) if actual == ty => expr,
+        // Inference and the transpiler type calls separately, so if they ever disagree,
+        // the value is boxed and the runtime converts it or panics
+        (actual, Some(ty)) => format!(
+            "kin_unbox_{}({})",
+            ty.c_type(),
+            actual.map_or(expr, |actual| actual.boxed(&expr))
+        ),
+    }
+}
+
+fn local_def<'a>(
+    stack: TranspileStack<'a>,
+    name: &'a str,
+    is_function: bool,
+) -> TranspileStack<'a> {
+    stack.with_kin_def(
+        name,
+        KinDef {
+            c_name: String::new(),
+            is_function,
+            ty: None,
+        },
+    )
+}
+
+// Whether every call in some items passes a check of its callee's def, which is None
+// for a caller that is not a name. Defs made in the items are given empty C names.
+fn items_calls<'a>(
+    items: &[Item<'a>],
+    mut stack: TranspileStack<'a>,
+    check: &mut dyn FnMut(Option<&KinDef>) -> bool,
+) -> bool {
+    for item in items {
+        let passes = match item {
+            Item::Def(def) if def.is_function() => {
+                stack = local_def(stack, def.ident.name, true);
+                let body_stack = def.params.iter().fold(stack.clone(), |stack, param| {
+                    local_def(stack, param.ident.name, false)
+                });
+                items_calls(&def.items, body_stack, check)
+            }
+            Item::Def(def) => {
+                let passes = items_calls(&def.items, stack.clone(), check);
+                stack = local_def(stack, def.ident.name, false);
+                passes
+            }
+            Item::Node(node) => node_calls(node, &stack, check),
+        };
+        if !passes {
+            return false;
+        }
+    }
+    true
+}
+
+fn node_calls<'a>(
+    node: &Node<'a>,
+    stack: &TranspileStack<'a>,
+    check: &mut dyn FnMut(Option<&KinDef>) -> bool,
+) -> bool {
+    match &node.kind {
+        NodeKind::Term(Term::Expr(items), _) => items_calls(items, stack.clone(), check),
+        NodeKind::Term(Term::Tree(nodes), _) => {
+            nodes.iter().all(|node| node_calls(node, stack, check))
+        }
+        // A closure's body only runs when it is called through a value
+        NodeKind::Term(..) => true,
+        NodeKind::BinExpr(expr) => {
+            node_calls(&expr.left, stack, check) && node_calls(&expr.right, stack, check)
+        }
+        NodeKind::UnExpr(expr) => node_calls(&expr.inner, stack, check),
+        NodeKind::Call(call) => {
+            let def = match &call.caller.kind {
+                NodeKind::Term(Term::Ident(ident), _) => stack.kin_def(ident.name),
+                _ => None,
+            };
+            check(def)
+                && node_calls(&call.caller, stack, check)
+                && call.args.iter().all(|arg| node_calls(arg, stack, check))
+        }
+    }
+}
+
+// Whether every call in the body of a function without captures passes a check
+fn body_calls<'a>(
+    source: &FunctionSource<'a>,
+    check: &mut dyn FnMut(Option<&KinDef>) -> bool,
+) -> bool {
+    let stack = source
+        .params
+        .iter()
+        .fold(source.stack.clone(), |stack, param| {
+            local_def(stack, param.ident.name, false)
+        });
+    items_calls(&source.items, stack, check)
+}
+
+// Whether a node's value may point to arena nodes allocated by its own function.
+// Params, captures, and globals all point to nodes allocated by callers.
+fn holds_nodes<'a>(node: &Node<'a>, locals: &[&str], scope: &dyn TypeScope<'a>) -> bool {
+    match &node.kind {
+        NodeKind::Term(term, _) => match term {
+            Term::Int(_) | Term::Real(_) | Term::String(_) => false,
+            Term::Ident(ident) => locals.contains(&ident.name),
+            Term::Expr(items) => {
+                let mut locals = locals.to_vec();
+                local_values(items, &mut locals);
+                let mut block = BlockScope::new(scope);
+                for item in items {
+                    if let Item::Def(def) = item {
+                        block.define(def);
+                    }
+                }
+                matches!(items.last(), Some(Item::Node(node)) if holds_nodes(node, &locals, &block))
+            }
+            Term::Tree(_) | Term::Closure(_) => true,
+        },
+        NodeKind::BinExpr(expr) => match expr.op {
+            BinOp::Or | BinOp::And => {
+                holds_nodes(&expr.left, locals, scope) || holds_nodes(&expr.right, locals, scope)
+            }
+            BinOp::Mom | BinOp::Dad => true,
+            BinOp::Add => !adds_numbers(expr, scope),
+            _ => false,
+        },
+        NodeKind::UnExpr(expr) => match expr.op {
+            UnOp::Neg => false,
+            UnOp::Head => holds_nodes(&expr.inner, locals, scope),
+        },
+        NodeKind::Call(_) => true,
+    }
+}
+
 impl<'a> Transpilation<'a> {
-    pub fn new() -> Self {
+    pub fn new(input: &'a str, parallel: bool) -> Self {
         Transpilation {
+            input,
+            line_starts: once(0)
+                .chain(input.match_indices('\n').map(|(i, _)| i + 1))
+                .collect(),
             functions: once("main")
                 // .chain(BUILTINS.iter().map(|bi| bi.0))
                 .map(|name| (name.into(), CFunction::new(name)))
                 .collect(),
             function_stack: once("main".into()).collect(),
+            call_sites: Vec::new(),
+            string_literals: Vec::new(),
+            string_literal_indices: HashMap::new(),
+            var_names: HashSet::new(),
+            var_owners: HashMap::new(),
+            name_suffixes: HashMap::new(),
+            sources: BTreeMap::new(),
+            clones: BTreeMap::new(),
+            return_types: Default::default(),
+            assumed_returns: Default::default(),
+            min_assumption: Cell::new(usize::MAX),
+            parallel,
+            tasks: BTreeSet::new(),
+            purity: Default::default(),
         }
     }
-    pub fn write(self) -> io::Result<()> {
+    // Write the transpiled program to build/main.c. With more than one shard, the
+    // functions other than main are split between build/shard{i}.c files, which
+    // include the declarations in build/shared.h.
+    pub fn write(self, shards: usize) -> io::Result<()> {
         fs::create_dir_all("build")?;
+        let sharded = shards > 1;
+        // Functions in different shards call each other, so they cannot be static
+        let linkage = if sharded { "" } else { "static " };
         let mut source = File::create("build/main.c")?;
 
         // Write headers
+        if sharded {
+            writeln!(source, "#define KIN_SHARDED")?;
+        }
         writeln!(source, "#include \"../clibs/kin.h\"")?;
         writeln!(source)?;
 
+        // Write call site table
+        writeln!(source, "static KinCallSite kin_sites[] = {{")?;
+        writeln!(source, "    {{ NULL, 0, 0 }},")?;
+        for site in &self.call_sites {
+            writeln!(
+                source,
+                "    {{ \"{}\", {}, {} }},",
+                site.kin_name, site.line, site.col
+            )?;
+        }
+        writeln!(source, "}};")?;
+        writeln!(source)?;
+
+        // Write string literal table
+        for (i, lit) in self.string_literals.iter().enumerate() {
+            writeln!(
+                source,
+                "kin_hashed_literal(kin_literal_{}, 0x{:016x}ull, {:?});",
+                i + 1,
+                fnv1a(lit.as_bytes()),
+                lit
+            )?;
+        }
+        writeln!(source, "{}KinInterned kin_literals[] = {{", linkage)?;
+        writeln!(source, "    {{ 0, 0, NULL }},")?;
+        for (i, lit) in self.string_literals.iter().enumerate() {
+            writeln!(
+                source,
+                "    {{ 0x{:016x}ull, {}, kin_literal_{}.chars }},",
+                fnv1a(lit.as_bytes()),
+                lit.len(),
+                i + 1
+            )?;
+        }
+        writeln!(source, "}};")?;
+        writeln!(source)?;
+
         // Write function declarations
-        for (name, cf) in self.functions.iter().filter(|&(name, _)| name != "main") {
-            if cf.captures.is_empty() {
-                writeln!(
-                    source,
-                    "KinValue {}(uint8_t count, KinValue* args);",
-                    name
-                )?;
-            } else {
-                writeln!(
-                    source,
-                    "KinValue {}(uint8_t count, KinValue* args, KinValue* captures);",
-                    name
-                )?;
+        self.write_declarations(&mut source, linkage)?;
+
+        if !sharded {
+            for (name, cf) in &self.functions {
+                self.write_function(&mut source, name, cf, linkage)?;
             }
+            self.write_tasks(&mut source, linkage)?;
+            return Ok(());
         }
-        writeln!(source)?;
+        self.write_function(&mut source, "main", &self.functions["main"], linkage)?;
+        self.write_tasks(&mut source, linkage)?;
 
-        // Write function definitions
-        for (name, cf) in &self.functions {
-            let main = name == "main";
-            // Write signature
-            if main {
-                writeln!(source, "int main(int argc, char** argv) {{")?;
-            } else if cf.captures.is_empty() {
-                writeln!(
-                    source,
-                    "KinValue {}(uint8_t count, KinValue* args) {{",
-                    name
-                )?;
-            } else {
-                writeln!(
-                    source,
-                    "KinValue {}(uint8_t count, KinValue* args, KinValue* captures) {{",
-                    name
-                )?;
-            }
-            // Write lines
-            for line in &cf.lines {
-                write!(source, "{:indent$}", "", indent = (line.indent + 1) * 4)?;
-                if let Some(type_name) = line.type_name {
-                    write!(source, "{} ", type_name)?;
-                }
-                if let Some(var_name) = &line.var_name {
-                    write!(source, "{} = ", var_name)?;
-                }
-                writeln!(
-                    source,
-                    "{}{}",
-                    line.value,
-                    if line.semicolon { ";" } else { "" }
-                )?;
-            }
-            // Clean up main
-            if main {
-                if let Some(expr) = cf.clone().pop_expr() {
-                    writeln!(source, "    {};", expr)?;
-                }
-                writeln!(source, "    return 0;")?;
+        // Write the declarations shared by the shards
+        let mut shared = File::create("build/shared.h")?;
+        writeln!(shared, "#ifndef KIN_SHARED_H")?;
+        writeln!(shared, "#define KIN_SHARED_H")?;
+        writeln!(shared)?;
+        writeln!(shared, "#define KIN_SHARD")?;
+        writeln!(shared, "#include \"../clibs/kin.h\"")?;
+        writeln!(shared)?;
+        writeln!(shared, "extern KinInterned kin_literals[];")?;
+        writeln!(shared)?;
+        self.write_declarations(&mut shared, linkage)?;
+        writeln!(shared, "#endif")?;
+
+        // Give each function to the shard with the fewest lines so far, largest first
+        let mut functions: Vec<_> = self
+            .functions
+            .iter()
+            .filter(|&(name, _)| name != "main")
+            .collect();
+        functions.sort_by_key(|(_, cf)| std::cmp::Reverse(cf.lines.len()));
+        let mut assigned = vec![(0, Vec::new()); shards];
+        for (name, cf) in functions {
+            let (lines, shard) = assigned.iter_mut().min_by_key(|(lines, _)| *lines).unwrap();
+            *lines += cf.lines.len() + 1;
+            shard.push(name);
+        }
+        for (i, (_, mut names)) in assigned.into_iter().enumerate() {
+            names.sort();
+            let mut source = File::create(format!("build/shard{}.c", i))?;
+            writeln!(source, "#include \"shared.h\"")?;
+            writeln!(source)?;
+            for name in names {
+                self.write_function(&mut source, name, &self.functions[name], linkage)?;
             }
-            // Close function
-            writeln!(source, "}}\n")?;
         }
 
         Ok(())
     }
+    fn write_declarations(&self, source: &mut impl Write, linkage: &str) -> io::Result<()> {
+        for (name, cf) in self.functions.iter().filter(|&(name, _)| name != "main") {
+            writeln!(source, "{}{};", linkage, cf.direct_signature(name))?;
+            if !cf.is_clone {
+                writeln!(source, "{}{};", linkage, cf.array_signature(name))?;
+            }
+            if self.tasks.contains(name) {
+                writeln!(source, "{}{};", linkage, cf.task_signature(name))?;
+            }
+        }
+        writeln!(source)
+    }
+    // Write the entry points of the clones that are spawned as tasks, which unpack the
+    // task's args and call the clone from the spawning call site
+    fn write_tasks(&self, source: &mut impl Write, linkage: &str) -> io::Result<()> {
+        for name in &self.tasks {
+            let cf = &self.functions[name];
+            let ret_type = cf.ret_type.unwrap();
+            let args = cf
+                .param_types
+                .iter()
+                .enumerate()
+                .map(|(i, ty)| format!("args[{}].{}", i, ty.map_or("Value", Type::field)))
+                .intersperse(", ".into())
+                .collect::<String>();
+            writeln!(source, "{}{} {{", linkage, cf.task_signature(name))?;
+            writeln!(source, "    kin_enter_frame(\"{}\");", cf.kin_name)?;
+            writeln!(
+                source,
+                "    kin_return_as(KinTaskSlot, (KinTaskSlot) {{ .{} = kin_call_static_as({}, {}_direct({}), site) }});",
+                ret_type.field(),
+                ret_type.c_type(),
+                name,
+                args
+            )?;
+            writeln!(source, "}}\n")?;
+        }
+        Ok(())
+    }
+    fn write_function(
+        &self,
+        source: &mut impl Write,
+        name: &str,
+        cf: &CFunction<'a>,
+        linkage: &str,
+    ) -> io::Result<()> {
+        let main = name == "main";
+        if cf.memo {
+            writeln!(
+                source,
+                "static kin_thread_local KinMemo kin_memo_{};\n",
+                name
+            )?;
+        }
+        // Write signature
+        if main {
+            // This is main, or the entry point of an embedded program
+            writeln!(source, "kin_main_entry {{")?;
+        } else {
+            writeln!(source, "{}{} {{", linkage, cf.direct_signature(name))?;
+        }
+        if main {
+            writeln!(source, "    kin_start_run();")?;
+            writeln!(source, "    kin_call_sites = kin_sites;")?;
+            writeln!(
+                source,
+                "    kin_intern_literals(kin_literals + 1, {});",
+                self.string_literals.len()
+            )?;
+        }
+        writeln!(source, "    kin_enter_frame(\"{}\");", cf.kin_name)?;
+        let self_captures = if cf.captures.is_empty() {
+            ""
+        } else {
+            ", captures"
+        };
+        // Write lines
+        for line in &cf.lines {
+            write!(source, "{:indent$}", "", indent = (line.indent + 1) * 4)?;
+            if let Some(type_name) = line.type_name {
+                write!(source, "{} ", type_name)?;
+            }
+            if let Some(var_name) = &line.var_name {
+                write!(source, "{} = ", var_name)?;
+            }
+            writeln!(
+                source,
+                "{}{}",
+                line.value.replace(SELF_CAPTURES, self_captures),
+                if line.semicolon { ";" } else { "" }
+            )?;
+        }
+        // Clean up main
+        if main {
+            if let Some(expr) = cf.clone().pop_expr() {
+                writeln!(source, "    {};", expr)?;
+            }
+            writeln!(source, "    kin_end_run();")?;
+        }
+        // Close function
+        writeln!(source, "}}\n")?;
+        // Write the entry point for calls through function values, which unpacks the args array
+        if !main && !cf.is_clone {
+            writeln!(source, "{}{} {{", linkage, cf.array_signature(name))?;
+            let args = (0..cf.params.len())
+                .map(|i| format!("{i} < count ? args[{i}] : KIN_NIL", i = i))
+                .chain((!cf.captures.is_empty()).then(|| "captures".into()))
+                .intersperse(", ".into())
+                .collect::<String>();
+            writeln!(source, "    return {}_direct({});", name, args)?;
+            writeln!(source, "}}\n")?;
+        }
+        Ok(())
+    }
     fn c_name_exists(&self, c_name: &str, function: bool) -> bool {
         RESERVED_NAMES.contains(&c_name)
-            || function && self.functions.keys().any(|name| name == c_name)
-            || !function
-                && self
-                    .functions
-                    .values()
-                    .flat_map(|cf| &cf.lines)
-                    .filter_map(|cf| cf.var_name.as_ref())
-                    .any(|var_name| var_name == c_name)
-    }
-    fn c_name_for(&self, kin_name: &str, function: bool) -> String {
+            || function
+                && (self.functions.contains_key(c_name)
+                    || c_name
+                        .strip_suffix("_direct")
+                        .map_or(false, |name| self.functions.contains_key(name)))
+            || !function && self.var_names.contains(c_name)
+    }
+    // Get an unused C name for a Kin name. Variable names are reserved for the current function.
+    fn c_name_for(&mut self, kin_name: &str, function: bool) -> String {
         let mut c_name = kin_name.to_owned();
         if c_name.starts_with("kin") || c_name.starts_with("Kin") {
             c_name = "_".to_owned() + &c_name;
         }
-        let mut i = 1;
+        // Names are never freed, so every suffix before the last one given out is taken
+        let key = (kin_name.to_owned(), function);
+        let mut i = self.name_suffixes.get(&key).copied().unwrap_or(1);
+        if i > 1 {
+            c_name = format!("{}_{}", kin_name, i);
+        }
         while self.c_name_exists(&c_name, function) {
             i += 1;
             c_name = format!("{}_{}", kin_name, i);
         }
+        self.name_suffixes.insert(key, i);
+        if !function {
+            self.declare_var(c_name.clone());
+        }
         c_name
     }
+    // Record a variable of the current function
+    fn declare_var(&mut self, c_name: String) {
+        let owner = self.function_stack.last().unwrap().clone();
+        self.var_names.insert(c_name.clone());
+        self.var_owners.insert(c_name, owner);
+    }
     fn start_c_function(&mut self, c_name: String, kin_name: &'a str) {
         self.functions
             .insert(c_name.clone(), CFunction::new(kin_name));
         self.function_stack.push(c_name);
     }
     fn finish_c_function(&mut self) {
+        let ret_type = self.c_function().ret_type;
+        // A body that ends in a tail call never gets here
+        let unreachable = self.c_function().exprs.is_empty();
+        let ret_expr = match ret_type {
+            Some(_) if unreachable => "0".into(),
+            _ => self.pop_expr_as(ret_type),
+        };
+        // The params may have been rebound by tail calls, but the cache key is the original args
+        let ret_expr = if self.c_function().memo && !unreachable {
+            let name = self.function_stack.last().unwrap().clone();
+            let (c_type, boxed) = match ret_type {
+                Some(ty) => (ty.c_type(), ty.boxed("kin_memo_result")),
+                None => ("KinValue", "kin_memo_result".into()),
+            };
+            let cf = self.c_function();
+            cf.push_line(ret_expr).name("kin_memo_result").ty(c_type);
+            cf.push_line(format!(
+                "kin_memo_store(&kin_memo_{}, {}, kin_memo_args, kin_memo_hash, {})",
+                name,
+                cf.params.len() + cf.captures.len(),
+                boxed
+            ));
+            "kin_memo_result".into()
+        } else {
+            ret_expr
+        };
         let cf = self.c_function();
-        let ret_expr = cf
-            .exprs
-            .front()
-            .cloned()
-            .unwrap_or_else(|| "KIN_NIL".into());
-        cf.exprs.pop_front().unwrap();
-        cf.push_line(format!("return {}", ret_expr));
+        cf.push_line(match (cf.release_arena, ret_type) {
+            (true, None) => format!("kin_return_release(kin_mark, {})", ret_expr),
+            (true, Some(ty)) => format!(
+                "kin_return_release_as({}, kin_mark, {})",
+                ty.c_type(),
+                ret_expr
+            ),
+            (false, None) => format!("kin_return({})", ret_expr),
+            (false, Some(ty)) => format!("kin_return_as({}, {})", ty.c_type(), ret_expr),
+        });
         self.function_stack.pop().unwrap();
     }
     fn curr_c_function(&mut self) -> &mut CFunction<'a> {
@@ -385,29 +1029,165 @@ impl<'a> Transpilation<'a> {
     fn push_expr(&mut self, expr: String) {
         self.c_function().push_expr(expr)
     }
+    // Register a call site in the current function and get its index in the site table
+    fn call_site(&mut self, span: &Span<'a>) -> usize {
+        let kin_name = self.curr_c_function().kin_name;
+        let (line, col) = self.line_col(span.start());
+        self.call_sites.push(CCallSite {
+            kin_name,
+            line,
+            col,
+        });
+        self.call_sites.len()
+    }
+    // Find the line and column of a byte offset in the input like pest's Position::line_col,
+    // which counts from the start of the input on every call
+    fn line_col(&self, offset: usize) -> (usize, usize) {
+        let line = match self.line_starts.binary_search(&offset) {
+            Ok(i) => i + 1,
+            Err(i) => i,
+        };
+        let start = self.line_starts[line - 1];
+        (line, self.input[start..offset].chars().count() + 1)
+    }
+    // Get the index of a string literal in the intern table, adding it if it is new
+    fn string_literal(&mut self, string: &str) -> usize {
+        if let Some(&i) = self.string_literal_indices.get(string) {
+            return i;
+        }
+        self.string_literals.push(string.into());
+        self.string_literal_indices
+            .insert(string.into(), self.string_literals.len());
+        self.string_literals.len()
+    }
+    fn types<'t>(&'t self, stack: &'t TranspileStack<'a>) -> Types<'t, 'a> {
+        Types {
+            transpilation: self,
+            stack,
+        }
+    }
+    // Infer the return type of a function's clone for the given param types. Recursive calls
+    // to the same clone are assumed to return each candidate type until one is consistent.
+    fn return_type(&self, c_name: &str, sig: &[Option<Type>]) -> Option<Type> {
+        let key = (c_name.to_owned(), sig.to_vec());
+        if let Some(ty) = self.return_types.borrow().get(&key) {
+            return *ty;
+        }
+        if let Some(i) = self
+            .assumed_returns
+            .borrow()
+            .iter()
+            .position(|(assumed, _)| *assumed == key)
+        {
+            self.min_assumption.set(self.min_assumption.get().min(i));
+            return self.assumed_returns.borrow()[i].1;
+        }
+        let source = &self.sources[c_name];
+        let stack =
+            source
+                .params
+                .iter()
+                .zip(sig)
+                .fold(source.stack.clone(), |stack, (param, ty)| {
+                    stack.with_kin_def(
+                        param.ident.name,
+                        KinDef {
+                            c_name: String::new(),
+                            is_function: false,
+                            ty: *ty,
+                        },
+                    )
+                });
+        let depth = self.assumed_returns.borrow().len();
+        let outer_min = self.min_assumption.replace(usize::MAX);
+        let body_type = |assumed: Option<Type>| {
+            self.assumed_returns
+                .borrow_mut()
+                .push((key.clone(), assumed));
+            let ty = items_type(&source.items, &self.types(&stack));
+            self.assumed_returns.borrow_mut().pop();
+            ty
+        };
+        let ty = body_type(None)
+            .into_iter()
+            .chain([Type::Int, Type::Real, Type::Bool])
+            .find(|&ty| body_type(Some(ty)) == Some(ty));
+        // The result can only be kept if it did not depend on an assumption about an outer clone
+        let min = self.min_assumption.get();
+        if min >= depth {
+            self.return_types.borrow_mut().insert(key, ty);
+        }
+        self.min_assumption.set(outer_min.min(min));
+        ty
+    }
+    // Get the clone of a function for the given param types, transpiling it if it is new
+    fn clone_function(&mut self, c_name: &str, sig: &[Option<Type>]) -> String {
+        let key = (c_name.to_owned(), sig.to_vec());
+        if let Some(clone_name) = self.clones.get(&key) {
+            return clone_name.clone();
+        }
+        let ret_type = self.return_type(c_name, sig);
+        let suffix = sig
+            .iter()
+            .map(|ty| ty.map_or("any", Type::name))
+            .intersperse("_")
+            .collect::<String>();
+        let clone_name = self.c_name_for(&format!("{}__{}", c_name, suffix), true);
+        self.clones.insert(key, clone_name.clone());
+        let source = self.sources[c_name].clone();
+        self.function(
+            clone_name.clone(),
+            source.kin_name,
+            source.params,
+            source.items,
+            source.stack,
+            sig.to_vec(),
+            ret_type,
+            source.memo,
+        );
+        self.functions.get_mut(&clone_name).unwrap().is_clone = true;
+        clone_name
+    }
     fn pop_expr(&mut self) -> String {
         self.c_function()
             .pop_expr()
             .unwrap_or_else(|| "KIN_NIL".into())
     }
-    fn items(&mut self, items: Items<'a>, mut stack: TranspileStack<'a>) {
+    fn pop_typed_expr(&mut self) -> (String, Option<Type>) {
+        self.c_function()
+            .pop_typed_expr()
+            .unwrap_or_else(|| ("KIN_NIL".into(), None))
+    }
+    // Pop an expression as the type inferred for it
+    fn pop_expr_as(&mut self, ty: Option<Type>) -> String {
+        let expr = self.pop_typed_expr();
+        expr_as(expr, ty)
+    }
+    // `tail` is whether the value of the node being transpiled is returned from its function
+    fn items(&mut self, items: Items<'a>, mut stack: TranspileStack<'a>, tail: bool) {
         let item_count = items.len();
         for (i, item) in items.into_iter().enumerate() {
-            stack = self.item(item, stack);
-            if i < item_count - 1 {
+            let last = i == item_count - 1;
+            stack = self.item(item, stack, tail && last);
+            if !last {
                 let cf = self.c_function();
-                if let Some(expr) = cf.pop_expr() {
+                if let Some((expr, _)) = cf.pop_typed_expr() {
                     cf.push_line(expr);
                 }
             }
         }
     }
 
-    fn item(&mut self, item: Item<'a>, stack: TranspileStack<'a>) -> TranspileStack<'a> {
+    fn item(
+        &mut self,
+        item: Item<'a>,
+        stack: TranspileStack<'a>,
+        tail: bool,
+    ) -> TranspileStack<'a> {
         match item {
             Item::Def(def) => self.def(def, stack),
             Item::Node(node) => {
-                self.node(node, stack.clone());
+                self.node(node, stack.clone(), tail);
                 stack
             }
         }
@@ -422,40 +1202,105 @@ impl<'a> Transpilation<'a> {
                 KinDef {
                     c_name: c_name.clone(),
                     is_function: true,
+                    ty: None,
                 },
             );
-            self.function(c_name, def.ident.name, def.params, def.items, stack.clone());
+            let source = FunctionSource {
+                kin_name: def.ident.name,
+                params: def.params.clone(),
+                items: def.items.clone(),
+                stack: stack.clone(),
+                memo: def.memo,
+            };
+            let param_types = vec![None; def.params.len()];
+            self.function(
+                c_name.clone(),
+                def.ident.name,
+                def.params,
+                def.items,
+                stack.clone(),
+                param_types,
+                None,
+                def.memo,
+            );
+            if self.functions[&c_name].captures.is_empty() {
+                self.sources.insert(c_name, source);
+            }
             stack
         } else {
             // Value
-            self.items(def.items, stack.clone());
+            self.items(def.items, stack.clone(), false);
             let cf = self.c_function();
-            let line = cf.pop_expr();
-            if let Some(line) = line {
-                cf.push_line(line).name(c_name.clone());
+            let mut ty = None;
+            if let Some((line, line_type)) = cf.pop_typed_expr() {
+                let line = cf.push_line(line).name(c_name.clone());
+                if let Some(line_type) = line_type {
+                    line.ty(line_type.c_type());
+                }
+                ty = line_type;
             }
             stack.with_kin_def(
                 def.ident.name,
                 KinDef {
                     c_name,
                     is_function: false,
+                    ty,
                 },
             )
         }
     }
-    fn node(&mut self, node: Node<'a>, stack: TranspileStack<'a>) {
+    fn node(&mut self, node: Node<'a>, stack: TranspileStack<'a>, tail: bool) {
         match node.kind {
-            NodeKind::Term(term, _) => self.term(term, stack),
-            NodeKind::BinExpr(expr) => self.bin_expr(expr, stack),
+            NodeKind::Term(term, _) => self.term(term, stack, tail),
+            NodeKind::BinExpr(expr) => self.bin_expr(expr, stack, tail),
             NodeKind::UnExpr(expr) => self.un_expr(expr, stack),
-            NodeKind::Call(expr) => self.call_expr(expr, stack),
+            NodeKind::Call(expr) => {
+                self.call_expr(expr, stack, tail, false);
+            }
         }
     }
-    fn bin_expr(&mut self, expr: BinExpr<'a>, stack: TranspileStack<'a>) {
-        self.node(*expr.left, stack.clone());
-        let left = self.pop_expr();
+    fn bin_expr(&mut self, expr: BinExpr<'a>, stack: TranspileStack<'a>, tail: bool) {
+        if let Some((cond, then, els, ty)) = ternary(&expr, &self.types(&stack)) {
+            let (cond, then, els) = (cond.clone(), then.clone(), els.clone());
+            return self.typed_ternary(cond, then, els, ty, stack, tail);
+        }
+        let left_type = node_type(&expr.left, &self.types(&stack));
+        let right_type = node_type(&expr.right, &self.types(&stack));
+        let ty = bin_op_type(expr.op, left_type, right_type);
+        if let (Some(ty), BinOp::Or | BinOp::And) = (ty, expr.op) {
+            return self.typed_and_or(expr, ty, stack, tail);
+        }
+        if let Some(ty) = ty {
+            // Both operands are unboxed, so the operator is plain C
+            let (left, right) = self.operands(*expr.left, *expr.right, stack);
+            let (left, right) = (expr_as(left, left_type), expr_as(right, right_type));
+            let c_op = match expr.op {
+                BinOp::Equals => "==",
+                BinOp::NotEquals => "!=",
+                BinOp::Less => "<",
+                BinOp::LessOrEqual => "<=",
+                BinOp::Greater => ">",
+                BinOp::GreaterOrEqual => ">=",
+                BinOp::Add => "+",
+                BinOp::Sub => "-",
+                BinOp::Mul => "*",
+                BinOp::Div => "/",
+                BinOp::Rem if ty == Type::Int => "%",
+                BinOp::Rem => {
+                    self.c_function()
+                        .push_typed_expr(format!("fmod({}, {})", left, right), Some(ty));
+                    return;
+                }
+                BinOp::Or | BinOp::And | BinOp::Mom | BinOp::Dad => unreachable!(),
+            };
+            self.c_function()
+                .push_typed_expr(format!("({} {} {})", left, c_op, right), Some(ty));
+            return;
+        }
         let (f, can_fail) = match expr.op {
             BinOp::Or | BinOp::And => {
+                self.node(*expr.left, stack.clone(), false);
+                let left = self.pop_expr();
                 let or = expr.op == BinOp::Or;
                 let temp_name = self.c_name_for("temp", false);
                 let cf = self.c_function();
@@ -467,10 +1312,12 @@ impl<'a> Transpilation<'a> {
                 ))
                 .no_semicolon();
                 cf.indent();
-                self.node(*expr.right, stack);
-                let right = self.pop_expr();
+                self.node(*expr.right, stack, tail);
                 let cf = self.c_function();
-                cf.push_line(right).name(&temp_name).no_type();
+                // A tail call leaves no value
+                if let Some(right) = cf.pop_expr() {
+                    cf.push_line(right).name(&temp_name).no_type();
+                }
                 cf.deindent();
                 cf.push_line("}").no_semicolon();
                 cf.push_expr(temp_name);
@@ -478,16 +1325,18 @@ impl<'a> Transpilation<'a> {
             }
             BinOp::Mom | BinOp::Dad => {
                 let mom = expr.op == BinOp::Mom;
-                self.node(*expr.right, stack);
+                self.node(*expr.left, stack.clone(), false);
+                let left = self.pop_expr();
+                self.node(*expr.right, stack, false);
                 let right = self.pop_expr();
                 let head_name = self.c_name_for("head", false);
                 let cf = self.c_function();
                 cf.push_line(if mom { left.clone() } else { right.clone() })
                     .name(&head_name);
                 cf.push_line(if mom {
-                    format!("{}.mom = &{}", head_name, right)
+                    format!("{0} = kin_with_mom({0}, {1})", head_name, right)
                 } else {
-                    format!("{}.dad = &{}", head_name, left)
+                    format!("{0} = kin_with_dad({0}, {1})", head_name, left)
                 });
                 cf.push_expr(head_name);
                 return;
@@ -504,78 +1353,429 @@ impl<'a> Transpilation<'a> {
             BinOp::Div => ("kin_div", true),
             BinOp::Rem => ("kin_rem", true),
         };
-        self.node(*expr.right, stack);
-        let right = self.pop_expr();
+        let (left, right) = self.operands(*expr.left, *expr.right, stack);
+        let (left, right) = (expr_as(left, None), expr_as(right, None));
         if can_fail {
-            let function_name = &self.curr_c_function().kin_name;
-            let (line, col) = expr.op_span.split().0.line_col();
-            let call_line = format!(
-                "kin_call_bin_op({}, {}, {}, \"{} {}:{}\")",
-                f, left, right, function_name, line, col
-            );
-            self.push_expr(call_line)
+            let site = self.call_site(&expr.op_span);
+            self.push_expr(format!("kin_op({}, {}, {}, {})", f, left, right, site))
         } else {
-            self.push_expr(format!("{}({}, {})", f, left, right))
+            self.push_expr(format!("kin_eq_op({}, {}, {})", f, left, right))
+        }
+    }
+    // Transpile the operands of an operator. In parallel builds, when both are calls to
+    // expensive pure functions, the left one is spawned as a task while the right one is
+    // evaluated, and the task is joined before the operator is applied.
+    fn operands(
+        &mut self,
+        left: Node<'a>,
+        right: Node<'a>,
+        stack: TranspileStack<'a>,
+    ) -> ((String, Option<Type>), (String, Option<Type>)) {
+        let spawn =
+            self.parallel && self.may_spawn(&left, &stack) && self.may_spawn(&right, &stack);
+        let task = match left.kind {
+            NodeKind::Call(call) if spawn => self.call_expr(call, stack.clone(), false, true),
+            _ => {
+                self.node(left, stack.clone(), false);
+                None
+            }
+        };
+        let left = self.pop_typed_expr();
+        self.node(right, stack, false);
+        let mut right = self.pop_typed_expr();
+        if let Some(task) = task {
+            // The right operand is evaluated before waiting for the task
+            let name = self.c_name_for("right", false);
+            let line = self.c_function().push_line(right.0).name(&name);
+            if let Some(ty) = right.1 {
+                line.ty(ty.c_type());
+            }
+            right.0 = name;
+            self.c_function().push_line(format!("kin_join(&{})", task));
+        }
+        (left, right)
+    }
+    // Whether a node is a call that may be worth spawning as a task, which is a direct
+    // call to a pure function without captures that calls itself
+    fn may_spawn(&self, node: &Node<'a>, stack: &TranspileStack<'a>) -> bool {
+        let call = match &node.kind {
+            NodeKind::Call(call) => call,
+            _ => return false,
+        };
+        match self.direct_callee(&call.caller, stack) {
+            Some(DirectCall {
+                c_name,
+                arity: Some(arity),
+                ..
+            }) => {
+                // A task would run on a thread that does not share the function's cache
+                arity <= TASK_ARGS
+                    && self.sources.contains_key(&c_name)
+                    && !self.sources[&c_name].memo
+                    && !body_calls(&self.sources[&c_name], &mut |def| {
+                        def.map_or(true, |def| def.c_name != c_name)
+                    })
+                    && self.is_pure(&c_name, &mut Vec::new())
+            }
+            _ => false,
         }
     }
+    // Whether a function without captures is pure, so calls to it may run on other threads.
+    // It may only call pure builtins, its own local functions, and other pure functions,
+    // so it has no effects and makes no calls through values.
+    fn is_pure(&self, c_name: &str, visiting: &mut Vec<String>) -> bool {
+        if let Some(&pure) = self.purity.borrow().get(c_name) {
+            return pure;
+        }
+        // A function in a cycle of calls is pure if the rest of the cycle is
+        if visiting.iter().any(|name| name == c_name) {
+            return true;
+        }
+        let source = match self.sources.get(c_name) {
+            Some(source) => source,
+            None => return false,
+        };
+        visiting.push(c_name.into());
+        let pure = body_calls(source, &mut |def| match def {
+            Some(def) if def.c_name.is_empty() => def.is_function,
+            Some(def) if def.is_function && self.sources.contains_key(&def.c_name) => {
+                self.is_pure(&def.c_name, visiting)
+            }
+            Some(def) => {
+                def.is_function
+                    && def.c_name.starts_with("kin_")
+                    && !IMPURE_BUILTINS.contains(&def.c_name.as_str())
+            }
+            None => false,
+        });
+        visiting.pop();
+        // Purity that was assumed for an outer function in a cycle is only known once it is checked
+        if !pure || visiting.is_empty() {
+            self.purity.borrow_mut().insert(c_name.into(), pure);
+        }
+        pure
+    }
+    // Transpile `cond and then or else` as an if/else on an unboxed temp
+    fn typed_ternary(
+        &mut self,
+        cond: Node<'a>,
+        then: Node<'a>,
+        els: Node<'a>,
+        ty: Type,
+        stack: TranspileStack<'a>,
+        tail: bool,
+    ) {
+        self.node(cond, stack.clone(), false);
+        let cond = self.pop_expr_as(Some(Type::Bool));
+        let temp_name = self.c_name_for("temp", false);
+        let cf = self.c_function();
+        cf.push_line("0").name(&temp_name).ty(ty.c_type());
+        cf.push_line(format!("if ({}) {{", cond)).no_semicolon();
+        for (i, branch) in [then, els].iter().cloned().enumerate() {
+            let cf = self.c_function();
+            if i == 1 {
+                cf.push_line("} else {").no_semicolon();
+            }
+            cf.indent();
+            self.node(branch, stack.clone(), tail);
+            // A tail call leaves no value
+            if !self.c_function().exprs.is_empty() {
+                let value = self.pop_expr_as(Some(ty));
+                self.c_function()
+                    .push_line(value)
+                    .name(&temp_name)
+                    .no_type();
+            }
+            self.c_function().deindent();
+        }
+        let cf = self.c_function();
+        cf.push_line("}").no_semicolon();
+        cf.push_typed_expr(temp_name, Some(ty));
+    }
+    // Transpile `and` or `or` on unboxed operands
+    fn typed_and_or(&mut self, expr: BinExpr<'a>, ty: Type, stack: TranspileStack<'a>, tail: bool) {
+        self.node(*expr.left, stack.clone(), false);
+        let left = self.pop_expr_as(Some(ty));
+        let temp_name = self.c_name_for("temp", false);
+        let cf = self.c_function();
+        cf.push_line(left).name(&temp_name).ty(ty.c_type());
+        cf.push_line(format!(
+            "if ({}{}) {{",
+            if expr.op == BinOp::Or { "!" } else { "" },
+            temp_name
+        ))
+        .no_semicolon();
+        cf.indent();
+        self.node(*expr.right, stack, tail);
+        if !self.c_function().exprs.is_empty() {
+            let right = self.pop_expr_as(Some(ty));
+            self.c_function()
+                .push_line(right)
+                .name(&temp_name)
+                .no_type();
+        }
+        let cf = self.c_function();
+        cf.deindent();
+        cf.push_line("}").no_semicolon();
+        cf.push_typed_expr(temp_name, Some(ty));
+    }
     fn un_expr(&mut self, expr: UnExpr<'a>, stack: TranspileStack<'a>) {
-        self.node(*expr.inner, stack);
-        let inner = self.pop_expr();
+        self.node(*expr.inner, stack, false);
+        let (inner, inner_type) = self.pop_typed_expr();
+        if let Some(ty) = un_op_type(&expr.op, inner_type) {
+            let expr = match expr.op {
+                UnOp::Neg => format!("(-{})", inner),
+                // An unboxed value has no mom or dad
+                UnOp::Head => inner,
+            };
+            self.c_function().push_typed_expr(expr, Some(ty));
+            return;
+        }
+        let inner = inner_type.map_or(inner.clone(), |ty| ty.boxed(&inner));
         let f = match expr.op {
             UnOp::Neg => "kin_neg",
             UnOp::Head => "kin_head",
         };
         self.push_expr(format!("{}({})", f, inner))
     }
-    fn call_expr(&mut self, call: CallExpr<'a>, stack: TranspileStack<'a>) {
-        self.node(*call.caller, stack.clone());
-        let f = self.pop_expr();
-        let mut params = Vec::new();
+    // Get the C function to call directly for a caller that is a known function without captures
+    fn direct_callee(&self, caller: &Node<'a>, stack: &TranspileStack<'a>) -> Option<DirectCall> {
+        let ident = match &caller.kind {
+            NodeKind::Term(Term::Ident(ident), _) => ident,
+            _ => return None,
+        };
+        let def = stack
+            .kin_scopes
+            .iter()
+            .rev()
+            .find_map(|scope| scope.get(ident.name))?;
+        if !def.is_function {
+            return None;
+        }
+        let self_call = self.function_stack.last() == Some(&def.c_name);
+        if !self_call && self.function_stack.contains(&def.c_name) {
+            return None;
+        }
+        match self.functions.get(&def.c_name) {
+            // The function's captures are not known until it is finished,
+            // but a recursive call can always pass its own
+            Some(cf) if self_call || cf.captures.is_empty() => Some(DirectCall {
+                c_name: def.c_name.clone(),
+                arity: Some(cf.params.len()),
+                self_call,
+            }),
+            Some(_) => None,
+            None => Some(DirectCall {
+                c_name: def.c_name.clone(),
+                arity: None,
+                self_call: false,
+            }),
+        }
+    }
+    // With `spawn`, a call to a clone with an unboxed return type is spawned as a task,
+    // whose name is returned so that it can be joined
+    fn call_expr(
+        &mut self,
+        call: CallExpr<'a>,
+        stack: TranspileStack<'a>,
+        tail: bool,
+        spawn: bool,
+    ) -> Option<String> {
+        let direct = self.direct_callee(&call.caller, &stack);
+        let f = if direct.is_none() {
+            self.node(*call.caller, stack.clone(), false);
+            self.pop_expr()
+        } else {
+            String::new()
+        };
+        let mut args = Vec::new();
         for node in call.args {
-            let param = self.node_expr(node, "arg", stack.clone());
-            params.push(param)
+            let arg = self.typed_node_expr(node, "arg", stack.clone());
+            args.push(arg)
+        }
+        let param_count = args.len();
+        if let Some(DirectCall {
+            c_name,
+            arity: Some(arity),
+            self_call,
+        }) = direct
+        {
+            // Pass exactly as many args as the function has params
+            args.resize(arity, ("KIN_NIL".into(), None));
+            let sig: Vec<Option<Type>> = args.iter().map(|(_, ty)| *ty).collect();
+            // Unboxed args are passed to a clone of the function with params of their types
+            let (c_name, self_call, param_types, ret_type) =
+                if sig.iter().any(Option::is_some) && self.sources.contains_key(&c_name) {
+                    let clone_name = self.clone_function(&c_name, &sig);
+                    let ret_type = self.functions[&clone_name].ret_type;
+                    let self_call = self.function_stack.last() == Some(&clone_name);
+                    (clone_name, self_call, sig, ret_type)
+                } else {
+                    (c_name, self_call, vec![None; arity], None)
+                };
+            let mut params: Vec<String> = args
+                .into_iter()
+                .zip(&param_types)
+                .map(|((arg, ty), param_type)| match (ty, param_type) {
+                    (Some(ty), None) => ty.boxed(&arg),
+                    _ => arg,
+                })
+                .collect();
+            if tail && self_call {
+                // A self call in tail position rebinds the params and jumps back to the start of the function
+                let param_names = self.c_function().params.clone();
+                if arity == 1 {
+                    self.c_function()
+                        .push_line(params.remove(0))
+                        .name(&param_names[0])
+                        .no_type();
+                } else {
+                    let nexts: Vec<String> = params
+                        .into_iter()
+                        .zip(&param_types)
+                        .map(|(param, ty)| {
+                            let next = self.c_name_for("next", false);
+                            let line = self.c_function().push_line(param).name(&next);
+                            if let Some(ty) = ty {
+                                line.ty(ty.c_type());
+                            }
+                            next
+                        })
+                        .collect();
+                    let cf = self.c_function();
+                    for (param_name, next) in param_names.iter().zip(nexts) {
+                        cf.push_line(next).name(param_name).no_type();
+                    }
+                }
+                let cf = self.c_function();
+                cf.push_line(format!("goto {}_start", c_name));
+                cf.tail_calls = true;
+                return None;
+            }
+            let site = self.call_site(&call.span);
+            let slots = params
+                .iter()
+                .zip(&param_types)
+                .map(|(param, ty)| {
+                    format!("{{ .{} = {} }}", ty.map_or("Value", Type::field), param)
+                })
+                .intersperse(", ".into())
+                .collect::<String>();
+            let mut args: String = params.into_iter().intersperse(", ".into()).collect();
+            if self_call {
+                args.push_str(SELF_CAPTURES);
+            }
+            if let (true, Some(ty)) = (spawn, ret_type) {
+                let task = self.c_name_for("task", false);
+                self.tasks.insert(c_name.clone());
+                let cf = self.c_function();
+                cf.push_line(format!("KinTask {}", task));
+                cf.push_line(format!(
+                    "kin_spawn({}, {}, {}, {}_direct({}), {}_task, {}, {})",
+                    task,
+                    ty.field(),
+                    ty.c_type(),
+                    c_name,
+                    args,
+                    c_name,
+                    site,
+                    slots
+                ));
+                cf.push_typed_expr(format!("{}.result.{}", task, ty.field()), ret_type);
+                return Some(task);
+            }
+            let call_line = match ret_type {
+                Some(ty) => format!(
+                    "kin_call_static_as({}, {}_direct({}), {})",
+                    ty.c_type(),
+                    c_name,
+                    args,
+                    site
+                ),
+                None => format!("kin_call_static({}_direct({}), {})", c_name, args, site),
+            };
+            self.c_function().push_typed_expr(call_line, ret_type);
+            return None;
         }
-        let param_count = params.len();
-        let params: String = params.into_iter().intersperse(", ".into()).collect();
-        let function_name = &self.curr_c_function().kin_name;
-        let (line, col) = call.span.split().0.line_col();
+        let params: String = args
+            .into_iter()
+            .map(|(arg, ty)| ty.map_or(arg.clone(), |ty| ty.boxed(&arg)))
+            .intersperse(", ".into())
+            .collect();
+        let site = self.call_site(&call.span);
         let params = if param_count == 1 {
             format!("&{}", params)
         } else {
-            format!("(KinValue[]) {{ {} }}", params)
+            format!("((KinValue[]) {{ {} }})", params)
         };
-        let call_line = format!(
-            "kin_call({}, {}, {}, \"{} {}:{}\")",
-            f, param_count, params, function_name, line, col
-        );
-        self.push_expr(call_line)
+        let call_line = if let Some(DirectCall { c_name, .. }) = direct {
+            format!(
+                "kin_call_static({}({}, {}), {})",
+                c_name, param_count, params, site
+            )
+        } else {
+            format!("kin_call({}, {}, {}, {})", f, param_count, params, site)
+        };
+        self.push_expr(call_line);
+        None
     }
     fn node_expr(&mut self, node: Node<'a>, name: &str, stack: TranspileStack<'a>) -> String {
         if node.kind.is_const() {
-            self.node(node, stack.clone());
+            self.node(node, stack.clone(), false);
             self.pop_expr()
         } else {
-            self.node(node, stack.clone());
+            self.node(node, stack.clone(), false);
             let left = self.pop_expr();
             let name = self.c_name_for(name, false);
             self.c_function().push_line(left).name(&name);
             name
         }
     }
-    fn term(&mut self, term: Term<'a>, stack: TranspileStack<'a>) {
+    // Like node_expr, but an unboxed value stays unboxed
+    fn typed_node_expr(
+        &mut self,
+        node: Node<'a>,
+        name: &str,
+        stack: TranspileStack<'a>,
+    ) -> (String, Option<Type>) {
+        let is_const = node.kind.is_const();
+        self.node(node, stack, false);
+        let (expr, ty) = self.pop_typed_expr();
+        if is_const {
+            return (expr, ty);
+        }
+        let name = self.c_name_for(name, false);
+        let line = self.c_function().push_line(expr).name(&name);
+        if let Some(ty) = ty {
+            line.ty(ty.c_type());
+        }
+        (name, ty)
+    }
+    fn term(&mut self, term: Term<'a>, stack: TranspileStack<'a>, tail: bool) {
         match term {
-            Term::Int(i) => self.push_expr(format!("new_int({})", i)),
-            Term::Real(f) => self.push_expr(format!("new_real({})", f)),
-            Term::String(s) => self.push_expr(format!("new_string({:?}, {})", s, s.len())),
-            Term::Expr(items) => self.items(items, stack),
+            Term::Int(i) => self
+                .c_function()
+                .push_typed_expr(i.to_string(), Some(Type::Int)),
+            Term::Real(f) => self
+                .c_function()
+                .push_typed_expr(real_literal(f), Some(Type::Real)),
+            Term::String(s) => {
+                let i = self.string_literal(&s);
+                self.push_expr(format!("kin_literal({}, {})", i, s.len()))
+            }
+            Term::Expr(items) => self.items(items, stack, tail),
             Term::Closure(closure) => {
                 let c_name = self.c_name_for("anon", true);
+                let param_types = vec![None; closure.params.len()];
                 self.function(
                     c_name.clone(),
                     "closure",
                     closure.params,
                     closure.body,
                     stack,
+                    param_types,
+                    None,
+                    false,
                 );
                 if self.functions.get(&c_name).unwrap().captures.is_empty() {
                     self.push_expr(format!("new_function(&{})", c_name))
@@ -588,7 +1788,7 @@ impl<'a> Transpilation<'a> {
                 let left = self.node_expr(left, "left", stack.clone());
                 let middle = self.node_expr(middle, "middle", stack.clone());
                 let right = self.node_expr(right, "right", stack.clone());
-                self.push_expr(format!("new_tree(&{}, &{}, &{})", left, middle, right))
+                self.push_expr(format!("kin_tree({}, {}, {})", left, middle, right))
             }
             Term::Ident(ident) => {
                 if let Some(def) = stack
@@ -597,33 +1797,16 @@ impl<'a> Transpilation<'a> {
                     .rev()
                     .find_map(|scope| scope.get(ident.name))
                 {
-                    if let Some((ident_i, value_name)) = self
-                        .function_stack
-                        .iter()
-                        .enumerate()
-                        .find_map(|(i, c_name)| {
-                            let cf = self.functions.get(c_name).unwrap();
-                            cf.lines
-                                .iter()
-                                .find_map(|line| {
-                                    line.var_name.as_ref().and_then(|vn| {
-                                        if vn == &def.c_name
-                                            || vn == &format!("{}_closure", def.c_name)
-                                        {
-                                            Some(vn.clone())
-                                        } else {
-                                            let derefed = format!("*{}", vn);
-                                            if derefed == def.c_name {
-                                                Some(derefed)
-                                            } else {
-                                                None
-                                            }
-                                        }
-                                    })
-                                })
-                                .map(|name| (i, name))
-                        })
-                        .filter(|(i, _)| self.function_stack.len() - i > 1)
+                    // A def is either a variable or a function with a closure variable
+                    if let Some((ident_i, value_name)) =
+                        [def.c_name.clone(), format!("{}_closure", def.c_name)]
+                            .iter()
+                            .find_map(|name| {
+                                let owner = self.var_owners.get(name)?;
+                                let i = self.function_stack.iter().position(|f| f == owner)?;
+                                Some((i, name.clone()))
+                            })
+                            .filter(|(i, _)| self.function_stack.len() - i > 1)
                     {
                         // Captures
                         let curr_stack_i = self.function_stack.len() - 1;
@@ -633,12 +1816,20 @@ impl<'a> Transpilation<'a> {
                             if last {
                                 let cf = self.c_function();
                                 let cap_i = cf.capture_index_of(&value_name);
-                                cf.push_expr(format!("captures[{}]", cap_i))
+                                let capture = format!("captures[{}]", cap_i);
+                                // Captures are boxed, but the type is still known
+                                match def.ty {
+                                    Some(ty) => cf.push_typed_expr(ty.unboxed(&capture), Some(ty)),
+                                    None => cf.push_expr(capture),
+                                }
                             } else {
                                 let cf = self.c_function_at(stack_i + 1);
                                 cf.push_capture(
                                     value_name.clone(),
-                                    prev.clone().unwrap_or_else(|| value_name.clone()),
+                                    prev.clone().unwrap_or_else(|| {
+                                        def.ty
+                                            .map_or(value_name.clone(), |ty| ty.boxed(&value_name))
+                                    }),
                                 );
                                 let cap_i = cf.capture_index_of(&value_name);
                                 prev = Some(format!("captures[{}]", cap_i));
@@ -646,7 +1837,8 @@ impl<'a> Transpilation<'a> {
                         }
                     } else {
                         // Non-captures
-                        self.push_expr(if def.is_function {
+                        let ty = def.ty;
+                        let expr = if def.is_function {
                             let is_closure = self
                                 .functions
                                 .get(&def.c_name)
@@ -658,7 +1850,8 @@ impl<'a> Transpilation<'a> {
                             }
                         } else {
                             def.c_name.clone()
-                        })
+                        };
+                        self.c_function().push_typed_expr(expr, ty)
                     }
                 } else if let Some(&(_, c_name)) = BUILTIN_VALUES
                     .iter()
@@ -678,45 +1871,168 @@ impl<'a> Transpilation<'a> {
         params: Params<'a>,
         items: Items<'a>,
         stack: TranspileStack<'a>,
+        param_types: Vec<Option<Type>>,
+        ret_type: Option<Type>,
+        memo: bool,
     ) {
-        self.start_c_function(c_name.clone(), kin_name);
-        let cf = self.c_function();
-        for i in 0..params.len() {
-            cf.push_line(format!("{i} < count ? &args[{i}] : &KIN_NIL", i = i))
-                .name(format!("{}_arg{}", c_name, i))
-                .ty("KinValue*");
+        // Release the nodes allocated by the function on return unless the return value may point to them.
+        // Closures created by the function only need heap environments in that case too.
+        let mut locals = Vec::new();
+        local_values(&items, &mut locals);
+        // Params rebound by a tail call may point to nodes allocated by an earlier iteration
+        let tail_calls = has_tail_call(&items, kin_name);
+        if tail_calls {
+            locals.extend(params.iter().map(|param| param.ident.name));
         }
+        let param_names: Vec<String> = (0..params.len())
+            .map(|i| format!("{}_arg{}", c_name, i))
+            .collect();
         let stack = params
             .into_iter()
-            .enumerate()
-            .fold(stack, |stack, (i, param)| {
+            .zip(param_names.clone())
+            .zip(param_types.clone())
+            .fold(stack, |stack, ((param, c_name), ty)| {
                 stack.with_kin_def(
                     param.ident.name,
                     KinDef {
-                        c_name: format!("*{}_arg{}", c_name, i),
+                        c_name,
                         is_function: false,
+                        ty,
                     },
                 )
             });
+        // Adding typed params allocates nothing, so whether the body allocates depends on their types
+        let types = Types {
+            transpilation: self,
+            stack: &stack,
+        };
+        // An unboxed return value points to nothing
+        let returns_locals = ret_type.is_none()
+            && matches!(items.last(), Some(Item::Node(node)) if holds_nodes(node, &locals, &types));
+        let release_arena = !returns_locals && items_allocate(&items, &types);
+        self.start_c_function(c_name.clone(), kin_name);
+        let cf = self.c_function();
+        // A closure passed to a tail call outlives the iteration that created it, whose
+        // captures array the next iteration would overwrite
+        cf.closures_escape = returns_locals || tail_calls;
+        cf.params = param_names;
+        cf.param_types = param_types;
+        cf.ret_type = ret_type;
+        for param in cf.params.clone() {
+            self.declare_var(param);
+        }
+        let cf = self.c_function();
+        if release_arena {
+            cf.release_arena = true;
+            cf.push_line("kin_arena_mark()")
+                .name("kin_mark")
+                .ty("KinArenaMark");
+        }
+        let start = cf.lines.len();
         // Transpile body items and finish function
-        self.items(items, stack);
+        self.items(items, stack, true);
+        // Give tail calls a place to jump to
+        let cf = self.curr_c_function();
+        if cf.tail_calls {
+            cf.insert_line(start, format!("{}_start:", c_name));
+        }
+        if memo {
+            // Look for a cached result before anything else. The captures are part of the key.
+            cf.memo = true;
+            let args = cf
+                .params
+                .iter()
+                .zip(&cf.param_types)
+                .map(|(param, ty)| ty.map_or(param.clone(), |ty| ty.boxed(param)))
+                .chain((0..cf.captures.len()).map(|i| format!("captures[{}]", i)))
+                .collect::<Vec<_>>();
+            let hit = match cf.ret_type {
+                Some(ty) => format!(
+                    "kin_return_as({}, {})",
+                    ty.c_type(),
+                    ty.unboxed("(*kin_memo_hit)")
+                ),
+                None => "kin_return(*kin_memo_hit)".into(),
+            };
+            cf.insert_line(0, format!("if (kin_memo_hit) {}", hit));
+            cf.insert_line(
+                0,
+                format!(
+                    "kin_memo_find(&kin_memo_{}, {}, kin_memo_args, &kin_memo_hash)",
+                    c_name,
+                    args.len()
+                ),
+            )
+            .name("kin_memo_hit")
+            .ty("KinValue*");
+            cf.insert_line(0, "0").name("kin_memo_hash").ty("uint64_t");
+            cf.insert_line(0, format!("{{ {} }}", args.join(", ")))
+                .name("kin_memo_args[]");
+        }
         let captures = self.curr_c_function().captures.clone();
         self.finish_c_function();
         // Set captures in parent scope
         if captures.is_empty() {
             return;
         }
-        let captures_name = format!("{}_captures", c_name);
         let closure_name = format!("{}_closure", c_name);
-        self.c_function()
-            .push_line(format!("KinValue {}[{}]", captures_name, captures.len()));
-        let cf = self.c_function();
-        for (i, cap) in captures.iter().enumerate() {
-            cf.push_line(&cap.capture_name)
-                .name(format!("{}[{}]", captures_name, i,))
-                .no_type();
+        self.declare_var(closure_name.clone());
+        if self.c_function().closures_escape {
+            // The closure may be returned, so its environment is allocated in the arena
+            let env_name = format!("{}_env", c_name);
+            self.declare_var(env_name.clone());
+            let cf = self.c_function();
+            cf.push_line(format!("kin_new_env(&{}, {})", c_name, captures.len()))
+                .name(&env_name)
+                .ty("KinEnv*");
+            for (i, cap) in captures.iter().enumerate() {
+                cf.push_line(&cap.capture_name)
+                    .name(format!("{}->captures[{}]", env_name, i))
+                    .no_type();
+            }
+            cf.push_line(format!("new_env_closure({})", env_name))
+                .name(closure_name);
+        } else {
+            let captures_name = format!("{}_captures", c_name);
+            self.declare_var(captures_name.clone());
+            let cf = self.c_function();
+            cf.push_line(format!("KinValue {}[{}]", captures_name, captures.len()));
+            for (i, cap) in captures.iter().enumerate() {
+                cf.push_line(&cap.capture_name)
+                    .name(format!("{}[{}]", captures_name, i,))
+                    .no_type();
+            }
+            cf.push_line(format!("new_closure(&{}, {})", c_name, captures_name))
+                .name(closure_name);
         }
-        cf.push_line(format!("new_closure(&{}, {})", c_name, captures_name))
-            .name(closure_name);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // A value whose type differs from the inferred one is converted at runtime instead of
+    // stopping the transpiler
+    #[test]
+    fn expr_as_mismatch() {
+        assert_eq!(
+            expr_as(("x".into(), Some(Type::Int)), Some(Type::Real)),
+            "kin_unbox_double(new_int(x))"
+        );
+        assert_eq!(
+            expr_as(("x".into(), None), Some(Type::Bool)),
+            "kin_unbox_bool(x)"
+        );
+        assert_eq!(expr_as(("x".into(), Some(Type::Int)), Some(Type::Int)), "x");
+        assert_eq!(expr_as(("x".into(), Some(Type::Real)), None), "new_real(x)");
+    }
+
+    #[test]
+    fn real_literals() {
+        assert_eq!(real_literal(-0.0), "-0.0");
+        assert_eq!(real_literal(2.0), "2.0");
+        assert_eq!(real_literal(1e300), "1e300");
+        assert_eq!(real_literal(-f64::INFINITY), "-HUGE_VAL");
     }
 }